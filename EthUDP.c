@@ -2,6 +2,9 @@
 	  by james@ustc.edu.cn 2009.04.02
 */
 
+// recvmmsg/sendmmsg
+#define _GNU_SOURCE 1
+
 // kernel use auxdata to send vlan tag, we use auxdata to reconstructe vlan header
 #define HAVE_PACKET_AUXDATA 1
 
@@ -16,29 +19,47 @@
 #include <syslog.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <time.h>
 #include <net/if.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <linux/filter.h>
+#include <linux/futex.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpu_relax()	_mm_pause()
+#else
+#define cpu_relax()	__asm__ __volatile__("":::"memory")
+#endif
 
 #define MAXLEN 			2048
 #define MAX_PACKET_SIZE		2048
 #define MAXFD   		64
+#define MAX_BATCH		1024
+#define MAX_QUEUES		64
+#define VNET_BUF_SIZE		(65536 + sizeof(struct virtio_net_hdr))
 
 #define STATUS_BAD 	0
 #define STATUS_OK  	1
@@ -56,14 +77,26 @@
 
 #ifdef ENABLE_OPENSSL
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/kdf.h>
 #define AES_128 2
 #define AES_192 3
-#define AES_256 3
+#define AES_256 4
+#define AES_128_GCM 5
+#define AES_256_GCM 6
+#define CHACHA20_POLY1305 7
 #else
 #define EVP_MAX_BLOCK_LENGTH 0
+#define EVP_MAX_IV_LENGTH 16
+#endif
+
+// make enables LZ4 compression if lz4.h is found
+#ifdef ENABLE_LZ4
+#include <lz4.h>
 #endif
 
 #define max(a,b)        ((a) > (b) ? (a) : (b))
+#define min(a,b)        ((a) < (b) ? (a) : (b))
 
 #ifdef HAVE_PACKET_AUXDATA
 #define VLAN_TAG_LEN   4
@@ -94,6 +127,38 @@ int read_only = 0, write_only = 0;
 int fixmss = 0;
 int nopromisc = 0;
 int loopback_check = 0;
+int benchmark = 0;
+int bench_threads = 1;		// -Bthreads n, run 1, 2, 4 ... n threads
+char *bench_json;		// -Bjson file
+int batch_size = 1;		// recvmmsg/sendmmsg batch size, 1 disable batch
+int flush_usec = 0;		// max usec a packet waits in send batch
+int rx_ring_blocks = 0;		// mode e TPACKET_V3 rx ring blocks, 0 disable
+int tx_ring_blocks = 0;		// mode e TPACKET_V3 tx ring blocks, 0 disable
+int tap_queues = 1;		// mode i/b multi-queue tap, one raw->udp and udp->raw thread per queue
+int cpu_list[MAX_QUEUES];	// pin queue n threads to cpu_list[n % cpu_count]
+int cpu_count = 0;
+int udp_shards = 1;		// SO_REUSEPORT udp sockets per master/slave, one udp->raw thread per socket
+int steer_cpu = 0;		// steer packets to udp socket of receiving cpu by SO_ATTACH_REUSEPORT_CBPF
+int tap_vnet = 0;		// tap IFF_VNET_HDR, read TSO super packets and segment them
+int udp_gso = 0;		// send with UDP_SEGMENT and recv with UDP_GRO, need batch
+int crypto_workers = 0;		// crypto worker threads per reader thread, 0 encrypt/decrypt in reader
+int rss_workers = 0;		// forward threads per reader thread, packets are spread by inner flow hash
+int compress_lz4 = 0;		// -z lz4, compress frames before encryption
+int aggregate = 0;		// -aggr usec, pack frames into one udp packet
+int aggr_usec = 0;		// max usec the first frame waits
+int aggr_size = 1400;		// -aggrsize, max bytes of packed frames, path MTU - ip/udp/tunnel/cipher overhead
+int path_mtu = 0;		// -mtu n, frames longer than path MTU allows are sent in fragments
+int frag_size[2];		// max plaintext bytes in one udp packet, set by set_frag_size()
+int pmtud = 0;			// -pmtud, probe path MTU
+int pmtu[2];			// path MTU to master/slave, by -mtu or -pmtud
+int multipath = 0;		// -mp flow|packet, MP_FLOW or MP_PACKET
+int hub_max = 0;		// -hub n, serve up to n peers on master udp socket, forward by learned MAC
+char *metrics_addr;		// -metrics, serve prometheus metrics on unix socket path or [host:]port
+char *pcap_prefix;		// -pcap, capture to prefix.N.pcapng after SIGUSR1 or GET /capture/start
+int pcap_points = 0xf;		// -pcappoints, mask of raw,enc,udp,dec
+int pcap_snaplen = 65535;	// -pcapsnap, bytes saved of each packet
+long pcap_file_size = 100 * 1024 * 1024;	// -pcapsize MB, then switch to next file
+int pcap_files = 10;		// -pcapfiles, keep prefix.0 .. prefix.(n-1), oldest overwritten
 
 int32_t ifindex;
 
@@ -102,8 +167,15 @@ int enc_algorithm;
 unsigned char enc_key[MAXLEN];
 unsigned char enc_iv[EVP_MAX_IV_LENGTH];
 int enc_key_len = 0;
+int enc_inplace = 0;		// cipher can encrypt/decrypt with buf == nbuf
+__thread u_int8_t *enc_aad, *dec_aad;	// AEAD additional data, tunnel header of the packet
+__thread int enc_aad_len, dec_aad_len;
 
 int fdudp[2], fdraw;
+int fdudps[2][MAX_QUEUES];	// SO_REUSEPORT udp sockets, fdudps[index][0] == fdudp[index]
+__thread int udp_shard;		// fdudps[][udp_shard] this thread uses
+int fdtapq[MAX_QUEUES];		// multi-queue tap fds, fdtapq[0] == fdraw
+__thread int raw_queue;		// queue of fdtapq this thread writes to
 int transfamily[2];
 int nat[2];
 
@@ -151,17 +223,18 @@ void err_msg(const char *fmt, ...)
 	return;
 }
 
-void Debug(const char *fmt, ...)
+void debug_msg(const char *fmt, ...)
 {
 	va_list ap;
-	if (debug) {
-		va_start(ap, fmt);
-		err_doit(0, LOG_INFO, fmt, ap);
-		va_end(ap);
-	}
+	va_start(ap, fmt);
+	err_doit(0, LOG_INFO, fmt, ap);
+	va_end(ap);
 	return;
 }
 
+// arguments are not evaluated when debug is off
+#define Debug(fmt, ...)	do { if (__builtin_expect(debug, 0)) debug_msg(fmt, ##__VA_ARGS__); } while (0)
+
 void err_quit(const char *fmt, ...)
 {
 	va_list ap;
@@ -205,6 +278,394 @@ void daemon_init(const char *pname, int facility)
 	openlog(pname, LOG_PID, facility);
 }
 
+/* per thread counters, each thread writes only its own cache line aligned block,
+ * metrics_thread() sums all blocks when asked
+ */
+enum {
+	ST_RAW_RX_PKTS, ST_RAW_RX_BYTES, ST_RAW_TX_PKTS, ST_RAW_TX_BYTES,
+	// udp counters of master and slave path, use ST_UDP_* + index
+	ST_UDP_TX_PKTS, ST_UDP_TX_PKTS_SLAVE, ST_UDP_TX_BYTES, ST_UDP_TX_BYTES_SLAVE,
+	ST_UDP_RX_PKTS, ST_UDP_RX_PKTS_SLAVE, ST_UDP_RX_BYTES, ST_UDP_RX_BYTES_SLAVE,
+	ST_DECRYPT_FAIL, ST_LOOPBACK_DROP, ST_UNKNOWN_HOST_DROP, ST_MSS_REWRITE, ST_SHORT_READ,
+	ST_SEND_EAGAIN, ST_SEND_ENOBUFS, ST_SEND_ERROR, ST_CAPTURE_DROP, ST_UNKNOWN_VNI_DROP,
+	ST_COMPRESSED, ST_COMP_SAVED, ST_COMP_BYPASS, ST_DECOMP_FAIL, ST_AGGR_PKTS, ST_AGGR_FRAMES, ST_AGGR_ERROR,
+	ST_FRAG_TX, ST_FRAG_REASM, ST_FRAG_DROP, ST_MP_REORDER, ST_MP_GAP, ST_MP_LATE, ST_MP_COLLIDE, ST_OVERSIZE_DROP, ST_REPLAY_DROP, ST_MAX
+};
+
+const char *stat_names[ST_MAX][2] = {
+	{"raw_rx_packets_total", "packets read from raw socket or tap"},
+	{"raw_rx_bytes_total", "bytes read from raw socket or tap"},
+	{"raw_tx_packets_total", "packets written to raw socket or tap"},
+	{"raw_tx_bytes_total", "bytes written to raw socket or tap"},
+	{"udp_tx_packets_total", "packets sent to remote udp"}, {"udp_tx_packets_total", NULL},
+	{"udp_tx_bytes_total", "bytes sent to remote udp"}, {"udp_tx_bytes_total", NULL},
+	{"udp_rx_packets_total", "packets received from remote udp"}, {"udp_rx_packets_total", NULL},
+	{"udp_rx_bytes_total", "bytes received from remote udp"}, {"udp_rx_bytes_total", NULL},
+	{"decrypt_failures_total", "packets failed to decrypt or authenticate"},
+	{"loopback_drops_total", "packets dropped by loopback check"},
+	{"unknown_host_drops_total", "packets dropped from unknown remote"},
+	{"mss_rewrites_total", "tcp syn packets with mss changed"},
+	{"short_reads_total", "read or recv returned error or 0"},
+	{"send_eagain_total", "send failed with EAGAIN"},
+	{"send_enobufs_total", "send failed with ENOBUFS"},
+	{"send_errors_total", "send failed with other errors"},
+	{"capture_drops_total", "packets not captured because capture ring was full"},
+	{"unknown_vni_drops_total", "packets dropped for bad tunnel header or unknown vni"},
+	{"compressed_packets_total", "packets sent lz4 compressed"},
+	{"compress_saved_bytes_total", "bytes saved by lz4 compression"},
+	{"compress_bypassed_total", "packets sent uncompressed, small, did not shrink or skipped"},
+	{"decompress_failures_total", "packets failed to decompress"},
+	{"aggregate_packets_total", "udp packets sent with more than one frame"},
+	{"aggregate_frames_total", "frames sent in aggregate packets"},
+	{"aggregate_errors_total", "received aggregate packets with bad frame length"},
+	{"fragments_sent_total", "udp packets sent as fragments of a frame"},
+	{"fragments_reassembled_total", "frames reassembled from fragments"},
+	{"fragments_dropped_total", "bad fragments and frames not complete in time"},
+	{"multipath_reordered_total", "packets waited in reorder buffer"},
+	{"multipath_gaps_total", "sequence numbers given up in reorder buffer"},
+	{"multipath_late_total", "packets arrived after their sequence was given up"},
+	{"multipath_collisions_total", "packets whose reorder slot was busy, duplicates dropped, others delivered unordered"},
+	{"oversize_drops_total", "frames longer than MAX_PACKET_SIZE read from raw socket or tap"},
+	{"replay_drops_total", "authenticated aead packets dropped by the replay window"},
+};
+
+enum { HIST_ENCAP, HIST_DECAP, HIST_MAX };	// ns from packet read to send, log2 buckets
+#define HIST_BUCKETS	32
+
+const char *hist_names[HIST_MAX][2] = {
+	{"encap_latency_seconds", "raw->udp processing time of one packet"},
+	{"decap_latency_seconds", "udp->raw processing time of one packet"},
+};
+
+struct thread_stats {
+	u_int64_t c[ST_MAX];
+	u_int64_t hist[HIST_MAX][HIST_BUCKETS];
+	u_int64_t hist_sum[HIST_MAX];
+} __attribute__ ((aligned(64)));
+
+#define MAX_STATS_THREADS	4096
+
+struct thread_stats *all_stats[MAX_STATS_THREADS];
+int nstats;
+struct thread_stats stats_overflow;	// shared by threads after MAX_STATS_THREADS, may lose counts
+__thread struct thread_stats *my_stats;
+
+static inline struct thread_stats *stats(void)
+{
+	if (my_stats == NULL) {
+		int n = __atomic_fetch_add(&nstats, 1, __ATOMIC_RELAXED);
+		if ((n < MAX_STATS_THREADS) && (posix_memalign((void **)&my_stats, 64, sizeof(struct thread_stats)) == 0)) {
+			memset(my_stats, 0, sizeof(struct thread_stats));
+			__atomic_store_n(&all_stats[n], my_stats, __ATOMIC_RELEASE);
+		} else
+			my_stats = &stats_overflow;
+	}
+	return my_stats;
+}
+
+static inline void stat_add(int i, u_int64_t n)
+{
+	struct thread_stats *s = stats();
+	__atomic_store_n(&s->c[i], s->c[i] + n, __ATOMIC_RELAXED);
+}
+
+static inline u_int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stat_hist(int h, u_int64_t ns)
+{
+	struct thread_stats *s = stats();
+	int b = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	__atomic_store_n(&s->hist[h][b], s->hist[h][b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->hist_sum[h], s->hist_sum[h] + ns, __ATOMIC_RELAXED);
+}
+
+#define STAT_RAW	-1	// stat_send() to raw socket or tap
+
+/* count result of sendto/write/sendmmsg to udp path index (MASTER/SLAVE) or STAT_RAW */
+void stat_send(int ret, int pkts, int bytes, int index)
+{
+	if (ret >= 0) {
+		stat_add(index == STAT_RAW ? ST_RAW_TX_PKTS : ST_UDP_TX_PKTS + index, pkts);
+		stat_add(index == STAT_RAW ? ST_RAW_TX_BYTES : ST_UDP_TX_BYTES + index, bytes);
+	} else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		stat_add(ST_SEND_EAGAIN, 1);
+	else if (errno == ENOBUFS)
+		stat_add(ST_SEND_ENOBUFS, 1);
+	else
+		stat_add(ST_SEND_ERROR, 1);
+}
+
+/* binary trace, build with make trace (-DENABLE_TRACE) and run with -trace file,
+ * each thread writes 16 bytes records to its own ring in the mmaped file, old records are overwritten,
+ * threads after TRACE_RINGS share rings (tid 0), so records are claimed by atomic add,
+ * EthUDP -T file prints the records of all threads by time
+ */
+enum {
+	TR_RAW_RX, TR_UDP_TX, TR_UDP_RX, TR_RAW_TX, TR_BATCH_FLUSH, TR_GSO_FALLBACK,
+	TR_DECRYPT_FAIL, TR_LOOPBACK_DROP, TR_UNKNOWN_HOST, TR_MSS_REWRITE, TR_MAX
+};
+
+const char *trace_names[TR_MAX][3] = {	// name, a, b
+	{"raw_rx", "len", ""},
+	{"udp_tx", "len", "index"},
+	{"udp_rx", "len", "index"},
+	{"raw_tx", "len", "queue"},
+	{"batch_flush", "pkts", "index"},
+	{"gso_fallback", "pkts", "gso_max_size"},
+	{"decrypt_fail", "len", "index"},
+	{"loopback_drop", "len", ""},
+	{"unknown_host", "len", "index"},
+	{"mss_rewrite", "old", "new"},
+};
+
+#define TRACE_MAGIC	0x45545243	// ETRC
+#define TRACE_RINGS	128
+#define TRACE_RING_SIZE	16384
+
+struct trace_rec {
+	u_int64_t ts;		// CLOCK_MONOTONIC ns
+	u_int16_t ev, a;
+	u_int32_t b;
+};
+
+struct trace_ring {
+	u_int64_t head;		// records written, record i is rec[i % TRACE_RING_SIZE]
+	u_int32_t tid;
+	u_int32_t pad[13];
+	struct trace_rec rec[TRACE_RING_SIZE];
+};
+
+struct trace_file {
+	u_int32_t magic, nrings, ring_size, used;
+	u_int32_t pad[12];
+	struct trace_ring ring[TRACE_RINGS];
+};
+
+#ifdef ENABLE_TRACE
+char *trace_file_name;		// -trace file
+struct trace_file *trace_map;
+__thread struct trace_ring *trace_ring;
+
+void trace_open(const char *file)
+{
+	int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (ftruncate(fd, sizeof(struct trace_file)) < 0))
+		err_sys("open trace file %s", file);
+	trace_map = mmap(NULL, sizeof(struct trace_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (trace_map == MAP_FAILED)
+		err_sys("mmap trace file %s", file);
+	close(fd);
+	trace_map->nrings = TRACE_RINGS;
+	trace_map->ring_size = TRACE_RING_SIZE;
+	trace_map->magic = TRACE_MAGIC;
+}
+
+void trace_write(int ev, u_int32_t a, u_int32_t b)
+{
+	struct trace_rec *r;
+	if (trace_ring == NULL) {
+		u_int32_t n = __atomic_fetch_add(&trace_map->used, 1, __ATOMIC_RELAXED);
+		trace_ring = &trace_map->ring[n % TRACE_RINGS];
+		__atomic_store_n(&trace_ring->tid, n < TRACE_RINGS ? syscall(SYS_gettid) : 0, __ATOMIC_RELAXED);
+	}
+	r = &trace_ring->rec[__atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_ACQ_REL) % TRACE_RING_SIZE];
+	r->ts = now_ns();
+	r->ev = ev;
+	r->a = a;
+	r->b = b;
+}
+
+#define TRACE(ev, a, b)	do { if (__builtin_expect(trace_map != NULL, 0)) trace_write(ev, a, b); } while (0)
+#else
+#define TRACE(ev, a, b)	do { } while (0)
+#endif
+
+/* packet capture to pcapng files, -pcap prefix arms it, SIGUSR1 or GET /capture/start|stop on -metrics socket
+ * starts and stops it. Forwarding threads copy packets to their own ring, drop if the ring is full,
+ * pcap_thread() writes the rings to prefix.N.pcapng, switching to next file every pcap_file_size bytes
+ */
+enum { PCAP_RAW, PCAP_ENC, PCAP_UDP, PCAP_DEC, PCAP_MAX };	// tap points, interface id in pcapng
+
+const char *pcap_point_names[PCAP_MAX] = { "raw", "enc", "udp", "dec" };
+
+#define PCAP_RING_SIZE	1024
+#define PCAP_MAX_RINGS	256
+#define PCAP_SLOT_DATA	(MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH + 64)
+
+struct pcap_slot {
+	u_int64_t ts;		// CLOCK_REALTIME ns
+	u_int16_t point, caplen;
+	u_int32_t len;
+	u_int8_t data[PCAP_SLOT_DATA];
+};
+
+struct pcap_ring {
+	u_int64_t head __attribute__ ((aligned(64)));	// written by forwarding thread
+	u_int64_t tail __attribute__ ((aligned(64)));	// written by pcap_thread
+	struct pcap_slot slot[PCAP_RING_SIZE];
+};
+
+struct pcap_ring *pcap_rings[PCAP_MAX_RINGS];
+int npcap_rings;
+__thread struct pcap_ring *pcap_ring;
+volatile int pcap_on;		// mask of tap points capturing now
+volatile int pcap_want;		// 1 start, 0 stop, set by SIGUSR1 and control socket
+
+void pcap_signal(int signo)
+{
+	pcap_want = !pcap_want;
+}
+
+void pcap_copy(int point, u_int8_t * buf, int len)
+{
+	struct pcap_ring *r = pcap_ring;
+	struct pcap_slot *s;
+	struct timespec ts;
+
+	if (r == NULL) {
+		int n = __atomic_fetch_add(&npcap_rings, 1, __ATOMIC_RELAXED);
+		if ((n >= PCAP_MAX_RINGS) || (posix_memalign((void **)&r, 64, sizeof(struct pcap_ring)) != 0)) {
+			pcap_ring = r = (struct pcap_ring *)-1;	// never capture in this thread
+		} else {
+			r->head = r->tail = 0;
+			pcap_ring = r;
+			__atomic_store_n(&pcap_rings[n], r, __ATOMIC_RELEASE);
+		}
+	}
+	if ((r == (struct pcap_ring *)-1) || (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= PCAP_RING_SIZE)) {
+		stat_add(ST_CAPTURE_DROP, 1);
+		return;
+	}
+	s = &r->slot[r->head % PCAP_RING_SIZE];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	s->point = point;
+	s->len = len;
+	s->caplen = len < pcap_snaplen ? len : pcap_snaplen;
+	memcpy(s->data, buf, s->caplen);
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#define PCAP_TAP(point, buf, len)	do { if (__builtin_expect(pcap_on & (1 << (point)), 0)) pcap_copy(point, buf, len); } while (0)
+
+/* write one pcapng block, body is padded to 4 bytes */
+int pcap_block(FILE * fp, u_int32_t type, const void *hdr, int hlen, const void *body, int blen)
+{
+	u_int32_t pad = 0, total = 12 + hlen + ((blen + 3) & ~3);
+	fwrite(&type, 4, 1, fp);
+	fwrite(&total, 4, 1, fp);
+	fwrite(hdr, hlen, 1, fp);
+	if (blen) {
+		fwrite(body, blen, 1, fp);
+		fwrite(&pad, (4 - blen) & 3, 1, fp);
+	}
+	fwrite(&total, 4, 1, fp);
+	return total;
+}
+
+FILE *pcap_open(int seq, long *written)
+{
+	char fname[MAXLEN];
+	FILE *fp;
+	int i;
+	struct {
+		u_int32_t magic;
+		u_int16_t major, minor;
+		int64_t section_len;
+	} __attribute__ ((packed)) shb = { 0x1A2B3C4D, 1, 0, -1 };
+
+	snprintf(fname, MAXLEN, "%s.%d.pcapng", pcap_prefix, seq % pcap_files);
+	fp = fopen(fname, "w");
+	if (fp == NULL) {
+		err_msg("pcap open %s error: %s", fname, strerror(errno));
+		return NULL;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+	*written = pcap_block(fp, 0x0A0D0D0A, &shb, sizeof(shb), NULL, 0);
+	for (i = 0; i < PCAP_MAX; i++) {	// one interface per tap point
+		struct {
+			u_int16_t linktype, reserved;
+			u_int32_t snaplen;
+		} idb;
+		u_int8_t opt[32];
+		int nlen = strlen(pcap_point_names[i]);
+		idb.linktype = ((i == PCAP_ENC) || (i == PCAP_UDP)) && (enc_key_len > 0) ? 147 : 1;	// USER0 for encrypted, else ETHERNET
+		idb.reserved = 0;
+		idb.snaplen = pcap_snaplen;
+		memset(opt, 0, sizeof(opt));
+		*(u_int16_t *) opt = 2;	// if_name
+		*(u_int16_t *) (opt + 2) = nlen;
+		memcpy(opt + 4, pcap_point_names[i], nlen);
+		*(u_int16_t *) (opt + 8) = 9;	// if_tsresol, 10^-9
+		*(u_int16_t *) (opt + 10) = 1;
+		opt[12] = 9;
+		*written += pcap_block(fp, 1, &idb, sizeof(idb), opt, 20);	// 8 name, 8 tsresol, 4 end of options
+	}
+	Debug("pcap write to %s", fname);
+	return fp;
+}
+
+/* drain all capture rings to pcapng files */
+void pcap_thread(void)
+{
+	FILE *fp = NULL;
+	long written = 0;
+	int seq = 0, i, n;
+
+	while (1) {
+		if (pcap_want && (fp == NULL)) {
+			for (i = 0; i < PCAP_MAX_RINGS; i++)	// skip packets left from last capture
+				if (pcap_rings[i])
+					__atomic_store_n(&pcap_rings[i]->tail, __atomic_load_n(&pcap_rings[i]->head, __ATOMIC_ACQUIRE),
+							 __ATOMIC_RELEASE);
+			fp = pcap_open(seq++, &written);
+			if (fp)
+				pcap_on = pcap_points;
+			else
+				pcap_want = 0;
+		} else if (!pcap_want && pcap_on) {
+			pcap_on = 0;
+			usleep(1000);	// packets being copied now
+		}
+		n = 0;
+		for (i = 0; fp && (i < npcap_rings) && (i < PCAP_MAX_RINGS); i++) {
+			struct pcap_ring *r = __atomic_load_n(&pcap_rings[i], __ATOMIC_ACQUIRE);
+			u_int64_t head;
+			if (r == NULL)
+				continue;
+			head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			for (; r->tail < head; n++) {
+				struct pcap_slot *s = &r->slot[r->tail % PCAP_RING_SIZE];
+				u_int32_t epb[5] = { s->point, s->ts >> 32, (u_int32_t) s->ts, s->caplen, s->len };
+				written += pcap_block(fp, 6, epb, sizeof(epb), s->data, s->caplen);
+				__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+			}
+		}
+		if (fp && !pcap_on) {	// stopped
+			fclose(fp);
+			fp = NULL;
+			Debug("pcap stopped");
+		} else if (fp && (written >= pcap_file_size)) {
+			fclose(fp);
+			fp = pcap_open(seq++, &written);
+			if (fp == NULL)
+				pcap_on = pcap_want = 0;
+		}
+		if (n == 0) {
+			if (fp)
+				fflush(fp);
+			usleep(fp ? 1000 : 100000);
+		}
+	}
+}
+
 int udp_server(const char *host, const char *serv, socklen_t * addrlenp, int index)
 {
 	int sockfd, n;
@@ -226,6 +687,8 @@ int udp_server(const char *host, const char *serv, socklen_t * addrlenp, int ind
 		if (sockfd < 0)
 			continue;	/* error, try next one */
 		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, 1);
+		if (udp_shards > 1)
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 		if (bind(sockfd, res->ai_addr, res->ai_addrlen) == 0)
 			break;	/* success */
 		close(sockfd);	/* bind error, close and try next one */
@@ -243,12 +706,38 @@ int udp_server(const char *host, const char *serv, socklen_t * addrlenp, int ind
 	return (sockfd);
 }
 
+/* select SO_REUSEPORT socket by cpu number: return cpu % udp_shards */
+void attach_reuseport_cbpf(int sockfd)
+{
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, udp_shards},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]),.filter = code };
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+		err_sys("setsockopt(so_attach_reuseport_cbpf)");
+}
+
+void enable_udp_gro(int index)
+{
+	int on = 1, s;
+	for (s = 0; s < udp_shards; s++)
+		if (setsockopt(fdudps[index][s], SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+			err_sys("setsockopt(udp_gro)");
+}
+
 int udp_xconnect(char *lhost, char *lserv, char *rhost, char *rserv, int index)
 {
-	int sockfd, n;
+	int sockfd, n, s;
 	struct addrinfo hints, *res, *ressave;
 
-	sockfd = udp_server(lhost, lserv, NULL, index);
+	for (s = 0; s < udp_shards; s++)
+		fdudps[index][s] = udp_server(lhost, lserv, NULL, index);
+	sockfd = fdudps[index][0];
+	if ((udp_shards > 1) && steer_cpu)
+		attach_reuseport_cbpf(sockfd);
 
 	bzero(&hints, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;
@@ -265,8 +754,15 @@ int udp_xconnect(char *lhost, char *lserv, char *rhost, char *rserv, int index)
 		return sockfd;
 	}
 
+	/* connected sockets are not load balanced by SO_REUSEPORT,
+	 * keep them unconnected and check remote address when recv
+	 */
 	do {
-		if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0) {
+		if ((udp_shards > 1) && (res->ai_family == transfamily[index])) {
+			memcpy((void *)&(remote_addr[index]), res->ai_addr, res->ai_addrlen);
+			break;
+		}
+		if ((udp_shards == 1) && (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0)) {
 			memcpy((void *)&(remote_addr[index]), res->ai_addr, res->ai_addrlen);
 			break;	/* success */
 		}
@@ -279,7 +775,10 @@ int udp_xconnect(char *lhost, char *lserv, char *rhost, char *rserv, int index)
 	freeaddrinfo(ressave);
 
 	n = 40 * 1024 * 1024;
-	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+	for (s = 0; s < udp_shards; s++)
+		setsockopt(fdudps[index][s], SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+	if (udp_gso)
+		enable_udp_gro(index);
 	if (debug) {
 		socklen_t ln;
 		if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &n, &ln) == 0) {
@@ -290,6 +789,130 @@ int udp_xconnect(char *lhost, char *lserv, char *rhost, char *rserv, int index)
 	return (sockfd);
 }
 
+/* PACKET_MMAP TPACKET_V3 rx/tx ring of mode e */
+#define RING_BLOCK_SIZE	(1 << 20)
+#define RING_FRAME_SIZE	2048
+#define RX_RING_BLOCK_TOV	1	// ms, kernel retire a not full block after this
+
+struct rx_ring {
+	u_int8_t *map;
+	int block_nr;
+	int cur;		// next block to read
+};
+
+struct tx_ring {
+	u_int8_t *map;
+	int frame_nr;
+	int cur;		// next frame to fill
+	int pending;		// frames filled but not kicked, atomic, kicked without the lock
+	pthread_mutex_t lock;	// master and slave udp threads share the ring
+};
+
+struct rx_ring rxring;
+struct tx_ring txring = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+void setup_packet_ring(int fd, int rx_block_nr, int tx_block_nr)
+{
+	struct tpacket_req3 req;
+	size_t rx_size = (size_t)RING_BLOCK_SIZE * rx_block_nr;
+	size_t tx_size = (size_t)RING_BLOCK_SIZE * tx_block_nr;
+	u_int8_t *map;
+	int val;
+
+	val = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) == -1)
+		err_sys("setsockopt(packet_version)");
+	if (rx_block_nr) {
+		val = VLAN_TAG_LEN;	// room to insert vlan tag before the frame
+		if (setsockopt(fd, SOL_PACKET, PACKET_RESERVE, &val, sizeof(val)) == -1)
+			err_sys("setsockopt(packet_reserve)");
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = RING_BLOCK_SIZE;
+		req.tp_block_nr = rx_block_nr;
+		req.tp_frame_size = RING_FRAME_SIZE;
+		req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * rx_block_nr;
+		req.tp_retire_blk_tov = RX_RING_BLOCK_TOV;
+		if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+			err_sys("setsockopt(packet_rx_ring)");
+	}
+	if (tx_block_nr) {
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = RING_BLOCK_SIZE;
+		req.tp_block_nr = tx_block_nr;
+		req.tp_frame_size = RING_FRAME_SIZE;
+		req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * tx_block_nr;
+		if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1)
+			err_sys("setsockopt(packet_tx_ring)");
+	}
+	// rx ring and tx ring must be mapped by one mmap, rx ring first
+	map = mmap(NULL, rx_size + tx_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (map == MAP_FAILED)
+		map = mmap(NULL, rx_size + tx_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		err_sys("mmap packet ring");
+	if (rx_block_nr) {
+		rxring.map = map;
+		rxring.block_nr = rx_block_nr;
+		Debug("rx ring %d blocks of %d bytes", rx_block_nr, RING_BLOCK_SIZE);
+	}
+	if (tx_block_nr) {
+		txring.map = map + rx_size;
+		txring.frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * tx_block_nr;
+		Debug("tx ring %d frames of %d bytes", txring.frame_nr, RING_FRAME_SIZE);
+	}
+}
+
+/* ask kernel to send all filled tx ring frames */
+void tx_ring_kick(void)
+{
+	if (__atomic_load_n(&txring.pending, __ATOMIC_RELAXED) == 0)
+		return;
+	if (__atomic_exchange_n(&txring.pending, 0, __ATOMIC_ACQ_REL) == 0)	// kicked by another thread
+		return;
+	if ((send(fdraw, NULL, 0, MSG_DONTWAIT) < 0) && (errno != EAGAIN))
+		Debug("tx ring send error: %s", strerror(errno));
+}
+
+/* copy packet to tx ring, sent by next tx_ring_kick() */
+/* return -1 and set errno if packet is dropped */
+int tx_ring_send(u_int8_t * buf, int len)
+{
+	struct tpacket3_hdr *hdr;
+	u_int32_t status;
+
+	if (len > RING_FRAME_SIZE - TPACKET_ALIGN(sizeof(struct tpacket3_hdr))) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pthread_mutex_lock(&txring.lock);
+	hdr = (struct tpacket3_hdr *)(txring.map + (size_t)txring.cur * RING_FRAME_SIZE);
+	status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	if ((status != TP_STATUS_AVAILABLE) && (status != TP_STATUS_WRONG_FORMAT)) {	// ring full, kick and wait a while
+		struct pollfd pfd;
+		__atomic_add_fetch(&txring.pending, 1, __ATOMIC_RELEASE);
+		tx_ring_kick();
+		pfd.fd = fdraw;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, 1);
+		status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+		if ((status != TP_STATUS_AVAILABLE) && (status != TP_STATUS_WRONG_FORMAT)) {
+			pthread_mutex_unlock(&txring.lock);
+			Debug("tx ring full, drop packet");
+			errno = ENOBUFS;
+			return -1;
+		}
+	}
+	memcpy((u_int8_t *) hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)), buf, len);
+	hdr->tp_len = len;
+	hdr->tp_snaplen = len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	txring.cur = (txring.cur + 1) % txring.frame_nr;
+	__atomic_add_fetch(&txring.pending, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&txring.lock);
+	return len;
+}
+
 /**
  * Open a rawsocket for the network interface
  */
@@ -372,7 +995,15 @@ int32_t open_socket(char *ifname, int32_t * rifindex)
 	return fd;
 }
 
-int xor_encrypt(u_int8_t * buf, int n, u_int8_t * nbuf)
+/* xor cipher
+   the key is expanded once into xor_stream, so packets are xored against a
+   flat aligned buffer instead of enc_key[i % enc_key_len] byte by byte */
+#define XOR_STREAM_LEN	(MAX_PACKET_SIZE + 64)
+
+u_int8_t xor_stream[XOR_STREAM_LEN] __attribute__ ((aligned(32)));
+
+// reference version, used for long packets and by -B
+int xor_encrypt_ref(u_int8_t * buf, int n, u_int8_t * nbuf)
 {
 	int i;
 	for (i = 0; i < n; i++)
@@ -380,137 +1011,615 @@ int xor_encrypt(u_int8_t * buf, int n, u_int8_t * nbuf)
 	return n;
 }
 
+void xor_block_scalar(u_int8_t * buf, int n, u_int8_t * nbuf)
+{
+	int i = 0;
+	u_int64_t a, k;
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&a, buf + i, 8);
+		memcpy(&k, xor_stream + i, 8);
+		a ^= k;
+		memcpy(nbuf + i, &a, 8);
+	}
+	for (; i < n; i++)
+		nbuf[i] = buf[i] ^ xor_stream[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((target("sse2")))
+void xor_block_sse2(u_int8_t * buf, int n, u_int8_t * nbuf)
+{
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i k = _mm_load_si128((const __m128i *)(xor_stream + i));
+		_mm_storeu_si128((__m128i *) (nbuf + i), _mm_xor_si128(a, k));
+	}
+	for (; i < n; i++)
+		nbuf[i] = buf[i] ^ xor_stream[i];
+}
+
+__attribute__ ((target("avx2")))
+void xor_block_avx2(u_int8_t * buf, int n, u_int8_t * nbuf)
+{
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i k = _mm256_load_si256((const __m256i *)(xor_stream + i));
+		_mm256_storeu_si256((__m256i *) (nbuf + i), _mm256_xor_si256(a, k));
+	}
+	for (; i < n; i++)
+		nbuf[i] = buf[i] ^ xor_stream[i];
+}
+#endif
+
+void (*xor_block) (u_int8_t * buf, int n, u_int8_t * nbuf) = xor_block_scalar;
+const char *xor_block_name = "scalar";
+
+void xor_setup(void)
+{
+	int i;
+	for (i = 0; i < XOR_STREAM_LEN; i++)
+		xor_stream[i] = enc_key[i % enc_key_len];
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		xor_block = xor_block_avx2;
+		xor_block_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		xor_block = xor_block_sse2;
+		xor_block_name = "sse2";
+	}
+#endif
+}
+
+// buf == nbuf is fine, xor works in place
+int xor_encrypt(u_int8_t * buf, int n, u_int8_t * nbuf)
+{
+	if (n > XOR_STREAM_LEN)
+		return xor_encrypt_ref(buf, n, nbuf);
+	xor_block(buf, n, nbuf);
+	return n;
+}
+
 #ifdef ENABLE_OPENSSL
+const EVP_CIPHER *enc_cipher;	// selected by setup_cipher()
+__thread EVP_CIPHER_CTX *enc_ctx, *dec_ctx;	// per thread, key schedule is done once
+
+EVP_CIPHER_CTX *new_cipher_ctx(int enc)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		err_quit("EVP_CIPHER_CTX_new error");
+	if (EVP_CipherInit_ex(ctx, enc_cipher, NULL, enc_key, enc_iv, enc) != 1)
+		err_quit("EVP_CipherInit_ex error");
+	return ctx;
+}
+
 int openssl_encrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
 {
-	EVP_CIPHER_CTX ctx;
 	int outlen1, outlen2;
 #ifdef DEBUGSSL
 	Debug("aes encrypt len=%d", len);
 #endif
-	EVP_CIPHER_CTX_init(&ctx);
-	if (enc_algorithm == AES_128)
-		EVP_EncryptInit(&ctx, EVP_aes_128_cbc(), enc_key, enc_iv);
-	else if (enc_algorithm == AES_192)
-		EVP_EncryptInit(&ctx, EVP_aes_192_cbc(), enc_key, enc_iv);
-	else if (enc_algorithm == AES_256)
-		EVP_EncryptInit(&ctx, EVP_aes_256_cbc(), enc_key, enc_iv);
-	EVP_EncryptUpdate(&ctx, nbuf, &outlen1, buf, len);
-	EVP_EncryptFinal(&ctx, nbuf + outlen1, &outlen2);
-	len = outlen1 + outlen2;
+	if (enc_ctx == NULL)
+		enc_ctx = new_cipher_ctx(1);
+	EVP_EncryptInit_ex(enc_ctx, NULL, NULL, NULL, enc_iv);	// reset iv only
+	if (EVP_EncryptUpdate(enc_ctx, nbuf, &outlen1, buf, len) != 1 || EVP_EncryptFinal_ex(enc_ctx, nbuf + outlen1, &outlen2) != 1)
+		len = 0;
+	else
+		len = outlen1 + outlen2;
 
 #ifdef DEBUGSSL
 	Debug("after aes encrypt len=%d", len);
 #endif
-	EVP_CIPHER_CTX_cleanup(&ctx);
 	return len;
 }
 
 int openssl_decrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
 {
-
-	EVP_CIPHER_CTX ctx;
 	int outlen1, outlen2;
 #ifdef DEBUGSSL
 	Debug("aes decrypt len=%d", len);
 #endif
-
-	EVP_CIPHER_CTX_init(&ctx);
-	if (enc_algorithm == AES_128)
-		EVP_DecryptInit(&ctx, EVP_aes_128_cbc(), enc_key, enc_iv);
-	else if (enc_algorithm == AES_192)
-		EVP_DecryptInit(&ctx, EVP_aes_192_cbc(), enc_key, enc_iv);
-	else if (enc_algorithm == AES_256)
-		EVP_DecryptInit(&ctx, EVP_aes_256_cbc(), enc_key, enc_iv);
-	if (EVP_DecryptUpdate(&ctx, nbuf, &outlen1, buf, len) != 1 || EVP_DecryptFinal(&ctx, nbuf + outlen1, &outlen2) != 1)
+	if (dec_ctx == NULL)
+		dec_ctx = new_cipher_ctx(0);
+	EVP_DecryptInit_ex(dec_ctx, NULL, NULL, NULL, enc_iv);	// reset iv only
+	if (EVP_DecryptUpdate(dec_ctx, nbuf, &outlen1, buf, len) != 1 || EVP_DecryptFinal_ex(dec_ctx, nbuf + outlen1, &outlen2) != 1)
 		len = 0;
 	else
 		len = outlen1 + outlen2;
 #ifdef DEBUGSSL
 	Debug("after aes decrypt len=%d", len);
 #endif
-	EVP_CIPHER_CTX_cleanup(&ctx);
 	return len;
 }
-#endif
 
-int do_encrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
+/* AEAD packet: sid(8) | counter(8) | ciphertext | tag
+ * every sender picks a random session id (sid) at start and encrypts with
+ * HKDF(key, sid), so master/slave, both directions and hub spokes never share
+ * a (key, nonce) pair, the nonce is 4 zero bytes + counter
+ * counter is lane << 56 | seq, every thread takes its own lane, no shared atomic
+ * receiver keeps a replay window of every lane of each sender in a set associative table sized
+ * by -hub n, an evicted sender keeps its key and highest counters, HKDF of unknown sids is rate limited
+ * tunnel header (VNI, flags, sequence) is sent in the clear but authenticated as AAD
+ * AEAD_HDR_LEN + AEAD_TAG_LEN fits in EVP_MAX_BLOCK_LENGTH room of packet buffers
+ */
+#define AEAD_HDR_LEN	16
+#define AEAD_TAG_LEN	16
+#define AEAD_LANES	16
+#define AEAD_REPLAY_WIN	256	// per lane
+#define AEAD_WAYS	4	// sessions per set, evict the least recently seen of the set
+#define AEAD_SESSIONS	16	// least sessions, hub has 2 * hub_max
+#define AEAD_CTX_CACHE	16	// per thread cipher contexts keyed for a session
+
+struct aead_lane {
+	u_int64_t seq;
+	char pad[56];		// one lane per cache line
+};
+
+struct aead_session {
+	u_int64_t sid;		// 0: empty slot
+	u_int32_t last_seen;	// myticket, for eviction
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	u_int64_t *win[AEAD_LANES];	// AEAD_REPLAY_WIN of counter + 1 seen in slot counter % AEAD_REPLAY_WIN, allocated at first use
+	u_int64_t base[AEAD_LANES];	// initial value of win, rejects counters of the sid before it was evicted
+};
+
+/* evicted session, direct mapped by sid, so a sender coming back needs no HKDF and cannot be replayed */
+struct aead_evicted {
+	u_int64_t sid;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	u_int64_t high[AEAD_LANES];	// highest counter + 1 seen
+};
+
+u_int64_t aead_sid;		// my session id, network order
+unsigned char aead_key[EVP_MAX_KEY_LENGTH];	// HKDF(enc_key, aead_sid)
+struct aead_lane aead_lanes[AEAD_LANES];
+int aead_next_lane;
+__thread int aead_lane = -1;
+struct aead_session *aead_sessions;
+struct aead_evicted *aead_evicted;
+int aead_nsessions;		// power of 2, multiple of AEAD_WAYS, also size of aead_evicted
+pthread_mutex_t aead_lock = PTHREAD_MUTEX_INITIALIZER;	// session add/evict, window allocation
+__thread EVP_CIPHER_CTX *aead_ctx[AEAD_CTX_CACHE];	// per thread, keyed for aead_ctx_sid
+__thread u_int64_t aead_ctx_sid[AEAD_CTX_CACHE];
+u_int32_t aead_derive_tick;
+int aead_derive_cnt;		// HKDF of unknown sids in second aead_derive_tick
+
+void aead_derive_key(u_int64_t sid, unsigned char *key)
 {
-	if (enc_key_len <= 0)
-		return 0;	// you should not call me!
-	if (enc_algorithm == XOR)
-		return xor_encrypt(buf, len, nbuf);
-#ifdef ENABLE_OPENSSL
-	if ((enc_algorithm == AES_128)
-	    || (enc_algorithm == AES_192)
-	    || (enc_algorithm == AES_256))
-		return openssl_encrypt(buf, len, nbuf);
-#endif
-	return 0;
+	EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	size_t len = EVP_CIPHER_key_length(enc_cipher);
+
+	if (pctx == NULL || EVP_PKEY_derive_init(pctx) != 1
+	    || EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) != 1
+	    || EVP_PKEY_CTX_set1_hkdf_salt(pctx, (unsigned char *)&sid, sizeof(sid)) != 1
+	    || EVP_PKEY_CTX_set1_hkdf_key(pctx, enc_key, enc_key_len) != 1
+	    || EVP_PKEY_CTX_add1_hkdf_info(pctx, (unsigned char *)"EthUDP aead", 11) != 1 || EVP_PKEY_derive(pctx, key, &len) != 1)
+		err_quit("HKDF error");
+	EVP_PKEY_CTX_free(pctx);
 }
 
-int do_decrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
+int aead_encrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
 {
-	if (enc_key_len <= 0)
-		return 0;	// you should not call me!
-	if (enc_algorithm == XOR)
-		return xor_encrypt(buf, len, nbuf);
-#ifdef ENABLE_OPENSSL
-	if ((enc_algorithm == AES_128)
-	    || (enc_algorithm == AES_192)
-	    || (enc_algorithm == AES_256))
-		return openssl_decrypt(buf, len, nbuf);
-#endif
-	return 0;
+	int outlen1, outlen2;
+	u_int64_t cnt;
+	u_int8_t nonce[12] = { 0 };
+
+	if (enc_ctx == NULL) {
+		enc_ctx = new_cipher_ctx(1);
+		if (EVP_EncryptInit_ex(enc_ctx, NULL, NULL, aead_key, NULL) != 1)
+			err_quit("EVP_EncryptInit_ex error");
+	}
+	if (aead_lane < 0)
+		aead_lane = __atomic_fetch_add(&aead_next_lane, 1, __ATOMIC_RELAXED) % AEAD_LANES;
+	// threads sharing a lane still get distinct counters
+	cnt = __atomic_fetch_add(&aead_lanes[aead_lane].seq, 1, __ATOMIC_RELAXED);
+	cnt = htobe64((u_int64_t) aead_lane << 56 | (cnt & 0xffffffffffffffULL));
+	memcpy(nbuf, &aead_sid, 8);
+	memcpy(nbuf + 8, &cnt, 8);
+	memcpy(nonce + 4, &cnt, 8);
+	if (EVP_EncryptInit_ex(enc_ctx, NULL, NULL, NULL, nonce) != 1
+	    || (enc_aad_len && EVP_EncryptUpdate(enc_ctx, NULL, &outlen1, enc_aad, enc_aad_len) != 1)
+	    || EVP_EncryptUpdate(enc_ctx, nbuf + AEAD_HDR_LEN, &outlen1, buf, len) != 1
+	    || EVP_EncryptFinal_ex(enc_ctx, nbuf + AEAD_HDR_LEN + outlen1, &outlen2) != 1
+	    || EVP_CIPHER_CTX_ctrl(enc_ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN, nbuf + AEAD_HDR_LEN + outlen1 + outlen2) != 1)
+		return 0;
+	return AEAD_HDR_LEN + outlen1 + outlen2 + AEAD_TAG_LEN;
 }
 
-char *stamp(void)
+u_int32_t aead_hash(u_int64_t sid)
 {
-	static char st_buf[200];
-	struct timeval tv;
-	struct timezone tz;
-	struct tm *tm;
-
-	gettimeofday(&tv, &tz);
-	tm = localtime(&tv.tv_sec);
+	return (u_int32_t) (sid ^ sid >> 32);	// sid is random
+}
 
-	snprintf(st_buf, 200, "%02d%02d %02d:%02d:%02d.%06ld", tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, tv.tv_usec);
-	return st_buf;
+/* slot of session sid, -1 if unknown */
+int aead_session_find(u_int64_t sid)
+{
+	int i, set = aead_hash(sid) & (aead_nsessions - 1) & ~(AEAD_WAYS - 1);
+	for (i = set; i < set + AEAD_WAYS; i++)
+		if (__atomic_load_n(&aead_sessions[i].sid, __ATOMIC_ACQUIRE) == sid)
+			return i;
+	return -1;
 }
 
-void printPacket(EtherPacket * packet, ssize_t packetSize, char *message)
+/* key of unknown sid, from evicted sessions or HKDF, return 0 if too many HKDF in this second */
+int aead_session_key(u_int64_t sid, unsigned char *key)
 {
-	printf("%s ", stamp());
+	struct aead_evicted *e = &aead_evicted[aead_hash(sid) & (aead_nsessions - 1)];
+	int found = 0;
 
-	if ((ntohl(packet->VLANTag) >> 16) == 0x8100)	// VLAN tag
-		printf("%s #%04x (VLAN %d) from %04x%08x to %04x%08x, len=%d\n",
-		       message, ntohs(packet->type),
-		       ntohl(packet->VLANTag) & 0xFFF, ntohs(packet->srcMAC1),
-		       ntohl(packet->srcMAC2), ntohs(packet->destMAC1), ntohl(packet->destMAC2), (int)packetSize);
-	else
-		printf("%s #%04x (no VLAN) from %04x%08x to %04x%08x, len=%d\n",
-		       message, ntohl(packet->VLANTag) >> 16,
-		       ntohs(packet->srcMAC1), ntohl(packet->srcMAC2), ntohs(packet->destMAC1), ntohl(packet->destMAC2), (int)packetSize);
-	fflush(stdout);
+	pthread_mutex_lock(&aead_lock);
+	if (e->sid == sid) {
+		memcpy(key, e->key, EVP_MAX_KEY_LENGTH);
+		found = 1;
+	}
+	pthread_mutex_unlock(&aead_lock);
+	if (found)
+		return 1;
+	if (aead_derive_tick != myticket) {	// racy reset, only a rough limit
+		aead_derive_tick = myticket;
+		aead_derive_cnt = 0;
+	}
+	if (__atomic_add_fetch(&aead_derive_cnt, 1, __ATOMIC_RELAXED) > aead_nsessions)
+		return 0;	// forged sids cost HKDF each, new senders wait for the next second
+	aead_derive_key(sid, key);
+	return 1;
 }
 
-// function from http://www.bloof.de/tcp_checksumming, thanks to crunsh
-u_int16_t tcp_sum_calc(u_int16_t len_tcp, u_int16_t src_addr[], u_int16_t dest_addr[], u_int16_t buff[])
+/* add authenticated session sid, evict the least recently seen of its set if full */
+int aead_session_add(u_int64_t sid, unsigned char *key)
 {
-	u_int16_t prot_tcp = 6;
-	u_int32_t sum = 0;
-	int nleft = len_tcp;
-	u_int16_t *w = buff;
+	struct aead_session *a;
+	struct aead_evicted *e;
+	int i, j, set, slot;
+	u_int64_t high;
+
+	pthread_mutex_lock(&aead_lock);
+	if ((i = aead_session_find(sid)) >= 0) {	// added by another thread
+		pthread_mutex_unlock(&aead_lock);
+		return i;
+	}
+	set = slot = aead_hash(sid) & (aead_nsessions - 1) & ~(AEAD_WAYS - 1);
+	for (i = set; i < set + AEAD_WAYS; i++) {
+		if (aead_sessions[i].sid == 0) {
+			slot = i;
+			break;
+		}
+		if (aead_sessions[i].last_seen < aead_sessions[slot].last_seen)
+			slot = i;
+	}
+	a = &aead_sessions[slot];
+	if (a->sid) {		// remember key and high counters of the evicted sid
+		e = &aead_evicted[aead_hash(a->sid) & (aead_nsessions - 1)];
+		e->sid = a->sid;
+		memcpy(e->key, a->key, EVP_MAX_KEY_LENGTH);
+		for (i = 0; i < AEAD_LANES; i++) {
+			e->high[i] = a->base[i];
+			if (a->win[i])
+				for (j = 0; j < AEAD_REPLAY_WIN; j++)
+					e->high[i] = max(e->high[i], a->win[i][j]);
+		}
+	}
+	__atomic_store_n(&a->sid, 0, __ATOMIC_RELEASE);
+	e = &aead_evicted[aead_hash(sid) & (aead_nsessions - 1)];
+	memcpy(a->key, key, EVP_MAX_KEY_LENGTH);
+	for (i = 0; i < AEAD_LANES; i++) {
+		high = e->sid == sid ? e->high[i] : 0;
+		a->base[i] = high;
+		if (a->win[i])
+			for (j = 0; j < AEAD_REPLAY_WIN; j++)
+				a->win[i][j] = high;
+	}
+	if (e->sid == sid)
+		e->sid = 0;
+	a->last_seen = myticket;
+	__atomic_store_n(&a->sid, sid, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&aead_lock);
+	Debug("aead new session %016llx in slot %d", (unsigned long long)be64toh(sid), slot);
+	return slot;
+}
 
-	/* calculate the checksum for the tcp header and payload */
-	while (nleft > 1) {
-		sum += *w++;
-		nleft -= 2;
+/* replay window of lane, allocated at the first packet of the lane */
+u_int64_t *aead_lane_win(struct aead_session *a, int lane)
+{
+	u_int64_t *w = __atomic_load_n(&a->win[lane], __ATOMIC_ACQUIRE);
+	int j;
+
+	if (w)
+		return w;
+	pthread_mutex_lock(&aead_lock);
+	if ((w = a->win[lane]) == NULL) {	// never freed, reused by the next session of the slot
+		w = malloc(AEAD_REPLAY_WIN * sizeof(u_int64_t));
+		if (w == NULL)
+			err_sys("malloc");
+		for (j = 0; j < AEAD_REPLAY_WIN; j++)
+			w[j] = a->base[lane];
+		__atomic_store_n(&a->win[lane], w, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&aead_lock);
+	return w;
+}
 
-	/* if nleft is 1 there ist still on byte left. We add a padding byte (0xFF) to build a 16bit word */
-	if (nleft > 0)
-		sum += *w & ntohs(0xFF00);	/* Thanks to Dalton */
+/* return 1 if counter cnt of session slot was seen or is older than the window */
+int aead_replay(int slot, u_int64_t cnt)
+{
+	u_int64_t *w = aead_lane_win(&aead_sessions[slot], cnt >> 56 & (AEAD_LANES - 1)) + cnt % AEAD_REPLAY_WIN;
+	u_int64_t old = __atomic_load_n(w, __ATOMIC_RELAXED);
+
+	do {
+		if (old >= cnt + 1)
+			return 1;
+	} while (!__atomic_compare_exchange_n(w, &old, cnt + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+/* return 0 if authentication failed or replayed */
+int aead_decrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
+{
+	int outlen1, outlen2, slot;
+	u_int64_t sid, cnt;
+	u_int8_t nonce[12] = { 0 };
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	EVP_CIPHER_CTX *ctx;
+
+	if (len < AEAD_HDR_LEN + AEAD_TAG_LEN)
+		return 0;
+	memcpy(&sid, buf, 8);
+	memcpy(&cnt, buf + 8, 8);
+	memcpy(nonce + 4, &cnt, 8);
+	cnt = be64toh(cnt);
+	if (dec_ctx == NULL)
+		dec_ctx = new_cipher_ctx(0);
+	slot = aead_session_find(sid);
+	if (slot < 0) {		// new sender, key is trusted only after authentication
+		if (!aead_session_key(sid, key))
+			return 0;
+		ctx = dec_ctx;
+		EVP_DecryptInit_ex(ctx, NULL, NULL, key, NULL);
+	} else {
+		int c = slot % AEAD_CTX_CACHE;
+		if (aead_ctx[c] == NULL)
+			aead_ctx[c] = new_cipher_ctx(0);
+		ctx = aead_ctx[c];
+		if (aead_ctx_sid[c] != sid) {
+			EVP_DecryptInit_ex(ctx, NULL, NULL, aead_sessions[slot].key, NULL);
+			aead_ctx_sid[c] = sid;
+		}
+	}
+	len -= AEAD_HDR_LEN + AEAD_TAG_LEN;
+	if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1
+	    || (dec_aad_len && EVP_DecryptUpdate(ctx, NULL, &outlen1, dec_aad, dec_aad_len) != 1)
+	    || EVP_DecryptUpdate(ctx, nbuf, &outlen1, buf + AEAD_HDR_LEN, len) != 1
+	    || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN, buf + AEAD_HDR_LEN + len) != 1
+	    || EVP_DecryptFinal_ex(ctx, nbuf + outlen1, &outlen2) != 1) {
+#ifdef DEBUGSSL
+		Debug("aead decrypt auth failed");
+#endif
+		return 0;
+	}
+	if (slot < 0)
+		slot = aead_session_add(sid, key);
+	if (aead_sessions[slot].last_seen != myticket)
+		aead_sessions[slot].last_seen = myticket;
+	if (!benchmark && aead_replay(slot, cnt)) {	// -B decrypts the same packets again
+		stat_add(ST_REPLAY_DROP, 1);
+		return 0;
+	}
+	return outlen1 + outlen2;
+}
+#endif
+
+int (*encrypt_func) (u_int8_t * buf, int len, u_int8_t * nbuf);
+int (*decrypt_func) (u_int8_t * buf, int len, u_int8_t * nbuf);
+
+/* select cipher once after options are parsed */
+void setup_cipher(void)
+{
+	encrypt_func = decrypt_func = NULL;
+	enc_inplace = 0;
+	if (enc_key_len <= 0)
+		return;
+	if (enc_algorithm == XOR) {
+		xor_setup();
+		encrypt_func = decrypt_func = xor_encrypt;
+		enc_inplace = 1;
+	}
+#ifdef ENABLE_OPENSSL
+	else if ((enc_algorithm == AES_128)
+		 || (enc_algorithm == AES_192)
+		 || (enc_algorithm == AES_256)) {
+		enc_cipher = enc_algorithm == AES_128 ? EVP_aes_128_cbc() : enc_algorithm == AES_192 ? EVP_aes_192_cbc() : EVP_aes_256_cbc();
+		encrypt_func = openssl_encrypt;
+		decrypt_func = openssl_decrypt;
+	} else if ((enc_algorithm == AES_128_GCM)
+		   || (enc_algorithm == AES_256_GCM)
+		   || (enc_algorithm == CHACHA20_POLY1305)) {
+		enc_cipher = enc_algorithm == AES_128_GCM ? EVP_aes_128_gcm() : enc_algorithm == AES_256_GCM ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+		while (aead_sid == 0)
+			if (RAND_bytes((unsigned char *)&aead_sid, sizeof(aead_sid)) != 1)
+				err_quit("RAND_bytes error");
+		aead_derive_key(aead_sid, aead_key);
+		for (aead_nsessions = AEAD_SESSIONS; aead_nsessions < 2 * hub_max; aead_nsessions *= 2) ;
+		aead_sessions = calloc(aead_nsessions, sizeof(struct aead_session));
+		aead_evicted = calloc(aead_nsessions, sizeof(struct aead_evicted));
+		if ((aead_sessions == NULL) || (aead_evicted == NULL))
+			err_sys("calloc");
+		encrypt_func = aead_encrypt;
+		decrypt_func = aead_decrypt;
+	}
+#endif
+}
+
+const char *enc_algorithm_name(void)
+{
+	return enc_algorithm == XOR ? "xor" :
+#ifdef ENABLE_OPENSSL
+	    enc_algorithm == AES_128 ? "aes-128" : enc_algorithm == AES_192 ? "aes-192" : enc_algorithm == AES_256 ? "aes-256" :
+	    enc_algorithm == AES_128_GCM ? "aes-128-gcm" : enc_algorithm == AES_256_GCM ? "aes-256-gcm" :
+	    enc_algorithm == CHACHA20_POLY1305 ? "chacha20-poly1305" :
+#endif
+	    "none";
+}
+
+/* max bytes encryption adds to a packet */
+int enc_overhead(void)
+{
+	if (encrypt_func == NULL)
+		return 0;
+#ifdef ENABLE_OPENSSL
+	if (encrypt_func == openssl_encrypt)
+		return EVP_MAX_BLOCK_LENGTH;	// cbc padding
+	if (encrypt_func == aead_encrypt)
+		return AEAD_HDR_LEN + AEAD_TAG_LEN;
+#endif
+	return 0;
+}
+
+char *stamp(void)
+{
+	static char st_buf[200];
+	struct timeval tv;
+	struct timezone tz;
+	struct tm *tm;
+
+	gettimeofday(&tv, &tz);
+	tm = localtime(&tv.tv_sec);
+
+	snprintf(st_buf, 200, "%02d%02d %02d:%02d:%02d.%06ld", tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, tv.tv_usec);
+	return st_buf;
+}
+
+void printPacket(EtherPacket * packet, ssize_t packetSize, char *message)
+{
+	printf("%s ", stamp());
+
+	if ((ntohl(packet->VLANTag) >> 16) == 0x8100)	// VLAN tag
+		printf("%s #%04x (VLAN %d) from %04x%08x to %04x%08x, len=%d\n",
+		       message, ntohs(packet->type),
+		       ntohl(packet->VLANTag) & 0xFFF, ntohs(packet->srcMAC1),
+		       ntohl(packet->srcMAC2), ntohs(packet->destMAC1), ntohl(packet->destMAC2), (int)packetSize);
+	else
+		printf("%s #%04x (no VLAN) from %04x%08x to %04x%08x, len=%d\n",
+		       message, ntohl(packet->VLANTag) >> 16,
+		       ntohs(packet->srcMAC1), ntohl(packet->srcMAC2), ntohs(packet->destMAC1), ntohl(packet->destMAC2), (int)packetSize);
+	fflush(stdout);
+}
+
+/* one's complement sum of buf, add to sum, result is not folded */
+u_int32_t csum_partial_ref(const u_int8_t * buf, int len, u_int32_t sum)
+{
+	const u_int16_t *w = (const u_int16_t *)buf;
+	u_int64_t s = sum;
+
+	while (len > 1) {
+		s += *w++;
+		len -= 2;
+	}
+	if (len > 0)
+		s += *(const u_int8_t *)w;	// little endian, pad zero
+	while (s >> 32)
+		s = (s & 0xffffffff) + (s >> 32);
+	return (u_int32_t) s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* add 32 bit words into 64 bit lanes, carries are folded at the end,
+   the sum of 32 bit words folds to the same 16 bit one's complement sum */
+static inline u_int32_t csum_fold64(u_int64_t s)
+{
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffffffff) + (s >> 32);
+	return (u_int32_t) s;
+}
+
+__attribute__ ((target("sse2")))
+u_int32_t csum_partial_sse2(const u_int8_t * buf, int len, u_int32_t sum)
+{
+	__m128i zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+	u_int64_t s[2];
+	int i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+	_mm_storeu_si128((__m128i *) s, acc);
+	sum = csum_partial_ref(buf + i, len - i, sum);
+	return csum_fold64((u_int64_t) csum_fold64(s[0]) + csum_fold64(s[1]) + sum);
+}
+
+__attribute__ ((target("avx2")))
+u_int32_t csum_partial_avx2(const u_int8_t * buf, int len, u_int32_t sum)
+{
+	__m256i zero = _mm256_setzero_si256(), acc = _mm256_setzero_si256();
+	u_int64_t s[4];
+	int i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+	_mm256_storeu_si256((__m256i *) s, acc);
+	sum = csum_partial_ref(buf + i, len - i, sum);
+	return csum_fold64((u_int64_t) csum_fold64(s[0]) + csum_fold64(s[1]) + csum_fold64(s[2]) + csum_fold64(s[3]) + sum);
+}
+#endif
+
+u_int32_t(*csum_partial) (const u_int8_t * buf, int len, u_int32_t sum) = csum_partial_ref;
+const char *csum_partial_name = "scalar";
+
+void csum_setup(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		csum_partial = csum_partial_avx2;
+		csum_partial_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		csum_partial = csum_partial_sse2;
+		csum_partial_name = "sse2";
+	}
+#endif
+}
+
+u_int16_t csum_fold(u_int32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (u_int16_t) ~ sum;
+}
+
+/* RFC 1624 incremental update, HC' = ~(~HC + ~m + m')
+   bytes hdr[off, off+n) are replaced by val, the 16 bit words covering
+   them are summed before and after, so odd off works too */
+void csum_replace(u_int16_t * check, u_int8_t * hdr, int off, const u_int8_t * val, int n)
+{
+	int start = off & ~1, end = (off + n + 1) & ~1;
+	u_int16_t old = ~csum_fold(csum_partial_ref(hdr + start, end - start, 0));
+	memcpy(hdr + off, val, n);
+	u_int16_t new = ~csum_fold(csum_partial_ref(hdr + start, end - start, 0));
+	*check = csum_fold((u_int16_t) ~ * check + (u_int16_t) ~ old + new);
+}
+
+// function from http://www.bloof.de/tcp_checksumming, thanks to crunsh
+u_int16_t tcp_sum_calc(u_int16_t len_tcp, u_int16_t src_addr[], u_int16_t dest_addr[], u_int16_t buff[])
+{
+	u_int16_t prot_tcp = 6;
+	u_int32_t sum = 0;
+	int nleft = len_tcp;
+	u_int16_t *w = buff;
+
+	/* calculate the checksum for the tcp header and payload */
+	while (nleft > 1) {
+		sum += *w++;
+		nleft -= 2;
+	}
+
+	/* if nleft is 1 there ist still on byte left. We add a padding byte (0xFF) to build a 16bit word */
+	if (nleft > 0)
+		sum += *w & ntohs(0xFF00);	/* Thanks to Dalton */
 
 	/* add the pseudo header */
 	sum += src_addr[0];
@@ -615,7 +1724,9 @@ void fix_mss(u_int8_t * buf, int len, int index)
 			if (opt[i] == 2 && tcph->doff * 4 - i >= 4 &&	// TCP_MSS
 			    opt[i + 1] == 4) {
 				u_int16_t newmss = 0, oldmss;
-				if (transfamily[index] == PF_INET)
+				if (frag_size[index])	// path mtu by -mtu or -pmtud
+					newmss = frag_size[index] - 14 - 40;
+				else if (transfamily[index] == PF_INET)
 					newmss = 1418;
 				else if (transfamily[index] == PF_INET6)
 					newmss = 1398;
@@ -629,13 +1740,10 @@ void fix_mss(u_int8_t * buf, int len, int index)
 				if (oldmss <= newmss)
 					return;
 				Debug("change inner v4 tcp mss from %d to %d", oldmss, newmss);
-				opt[i + 2] = (newmss & 0xff00) >> 8;
-				opt[i + 3] = newmss & 0x00ff;
-
-				tcph->check = 0;	/* Checksum field has to be set to 0 before checksumming */
-				tcph->check = (u_int16_t)
-				    tcp_sum_calc((u_int16_t)
-						 (ntohs(ip->tot_len) - ip->ihl * 4), (u_int16_t *) & ip->saddr, (u_int16_t *) & ip->daddr, (u_int16_t *) tcph);
+				TRACE(TR_MSS_REWRITE, oldmss, newmss);
+				newmss = htons(newmss);
+				csum_replace(&tcph->check, opt, i + 2, (u_int8_t *) & newmss, 2);
+				stat_add(ST_MSS_REWRITE, 1);
 				return;
 			}
 		}
@@ -661,7 +1769,9 @@ void fix_mss(u_int8_t * buf, int len, int index)
 			if (opt[i] == 2 && tcph->doff * 4 - i >= 4 &&	// TCP_MSS
 			    opt[i + 1] == 4) {
 				u_int16_t newmss = 0, oldmss;
-				if (transfamily[index] == PF_INET)
+				if (frag_size[index])
+					newmss = frag_size[index] - 14 - 60;
+				else if (transfamily[index] == PF_INET)
 					newmss = 1398;
 				else if (transfamily[index] == PF_INET6)
 					newmss = 1378;
@@ -675,15 +1785,10 @@ void fix_mss(u_int8_t * buf, int len, int index)
 				if (oldmss <= newmss)
 					return;
 				Debug("change inner v6 tcp mss from %d to %d", oldmss, newmss);
-
-				opt[i + 2] = (newmss & 0xff00) >> 8;
-				opt[i + 3] = newmss & 0x00ff;
-
-				tcph->check = 0;	/* Checksum field has to be set to 0 before checksumming */
-				tcph->check = (u_int16_t) tcp_sum_calc_v6((u_int16_t)
-									  ntohs(ip6->ip6_plen),
-									  (u_int16_t *) & ip6->ip6_src, (u_int16_t *) & ip6->ip6_dst, (u_int16_t *)
-									  tcph);
+				TRACE(TR_MSS_REWRITE, oldmss, newmss);
+				newmss = htons(newmss);
+				csum_replace(&tcph->check, opt, i + 2, (u_int8_t *) & newmss, 2);
+				stat_add(ST_MSS_REWRITE, 1);
 				return;
 			}
 		}
@@ -773,216 +1878,1938 @@ int do_loopback_check(u_int8_t * buf, int len)
 	return 0;
 }
 
+/* tunnel header, -vni: 4 bytes before each udp payload, outside of encryption,
+ * 4 bits magic, 4 bits flags, 24 bits VNI of the segment, in network order.
+ * segs[0] is the interface of command line, -seg adds more raw sockets (mode e) or taps (mode i/b)
+ */
+#define TUN_HDR_LEN	4
+#define TUN_MAGIC	0xE
+#define TUN_F_COMP	0x1	// payload is LZ4 compressed
+#define TUN_F_AGGR	0x2	// payload is frames packed by aggr_add()
+#define TUN_F_FRAG	0x4	// payload is a fragment by frag_send()
+#define TUN_F_SEQ	0x8	// data packet of -mp packet, sequence after the header
+#define TUN_HDR_MAX	8	// -mp packet adds 4 bytes sequence
+#define MAX_SEGS	64
+
+struct segment {
+	u_int32_t vni;
+	int fd;
+	int32_t ifindex;	// mode e
+	char *ifname, *bridge;
+};
+
+struct segment segs[MAX_SEGS];
+int nsegs = 1;
+int tun_hdr_len = 0;		// TUN_HDR_LEN if -vni, TUN_HDR_MAX if -mp packet
+int tx_data_flags = 0;		// TUN_F_SEQ if -mp packet
+u_int32_t mp_seq;		// last sequence sent
+u_int32_t mp_tx_epoch;		// top 8 bits of sequence, random at start, never 0
+__thread int tx_seg;		// segment this thread reads frames from
+__thread int raw_seg;		// segment of the frame being written to raw socket or tap
+__thread int tx_flags;		// TUN_F_* of the frame being sent
+
+static inline void tun_hdr_put(u_int8_t * p, int flags)
+{
+	u_int32_t h = htonl((TUN_MAGIC << 28) | (flags << 24) | segs[tx_seg].vni);
+	memcpy(p, &h, TUN_HDR_LEN);
+	if (tun_hdr_len > TUN_HDR_LEN) {	// sequence of data packets, 0 for others
+		h = 0;
+		if (flags & TUN_F_SEQ)
+			h = mp_tx_epoch << 24 | (__sync_add_and_fetch(&mp_seq, 1) & 0xffffff);
+		h = htonl(h);
+		memcpy(p + TUN_HDR_LEN, &h, 4);
+	}
+}
+
+/* return segment of the packet and its TUN_F_* flags, -1 if bad header or unknown VNI, few segments, linear search */
+int tun_hdr_seg(u_int8_t * p, int len, int *flags)
+{
+	u_int32_t h, vni;
+	int s;
+	if (len < TUN_HDR_LEN)
+		return -1;
+	memcpy(&h, p, TUN_HDR_LEN);
+	h = ntohl(h);
+	if ((h >> 28) != TUN_MAGIC)
+		return -1;
+	vni = h & 0xffffff;
+	*flags = (h >> 24) & 0xf;
+	for (s = 0; s < nsegs; s++)
+		if (segs[s].vni == vni)
+			return s;
+	return -1;
+}
+
+/* tunnel header of the next packet to send, built by do_encrypt() as AEAD AAD and sent as is */
+__thread u_int8_t tx_hdr[TUN_HDR_MAX];
+__thread int tx_hdr_set;
+
+/* copy tunnel header of the packet being sent to p */
+static inline void tx_hdr_take(u_int8_t * p)
+{
+	if (!tx_hdr_set)	// not encrypted
+		tun_hdr_put(tx_hdr, tx_flags);
+	memcpy(p, tx_hdr, tun_hdr_len);
+	tx_hdr_set = 0;
+}
+
+int do_encrypt(u_int8_t * buf, int len, u_int8_t * nbuf)
+{
+	if (encrypt_func == NULL)
+		return 0;	// you should not call me!
+	if (tun_hdr_len) {
+		tun_hdr_put(tx_hdr, tx_flags);
+		tx_hdr_set = 1;
+	}
+	enc_aad = tx_hdr;
+	enc_aad_len = tun_hdr_len;
+	return encrypt_func(buf, len, nbuf);
+}
+
+/* hdr is the tunnel header before buf */
+int do_decrypt(u_int8_t * buf, int len, u_int8_t * nbuf, u_int8_t * hdr)
+{
+	if (decrypt_func == NULL)
+		return 0;	// you should not call me!
+	dec_aad = hdr;
+	dec_aad_len = tun_hdr_len;
+	return decrypt_func(buf, len, nbuf);
+}
+
 void send_udp_to_remote(u_int8_t * buf, int len, int index)	// send udp packet to remote 
 {
+	u_int8_t hdr[TUN_HDR_MAX];
+	struct iovec iov[2];
+	struct msghdr msg;
+	int ret = 0;
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = tun_hdr_len;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	msg.msg_iov = tun_hdr_len ? iov : iov + 1;
+	msg.msg_iovlen = tun_hdr_len ? 2 : 1;
+	if (tun_hdr_len)
+		tx_hdr_take(hdr);
 	if (nat[index]) {
 		char rip[200];
 		if (remote_addr[index].ss_family == AF_INET) {
 			struct sockaddr_in *r = (struct sockaddr_in *)(&remote_addr[index]);
 			Debug("nat mode: send len %d to %s:%d", len, inet_ntop(r->sin_family, (void *)&r->sin_addr, rip, 200), ntohs(r->sin_port));
-			if (r->sin_port)
-				sendto(fdudp[index], buf, len, 0, (struct sockaddr *)&remote_addr[index], sizeof(struct sockaddr_storage));
+			if (r->sin_port == 0)
+				return;
 		} else if (remote_addr[index].ss_family == AF_INET6) {
 			struct sockaddr_in6 *r = (struct sockaddr_in6 *)&remote_addr[index];
 			Debug("nat mode: send len %d to [%s]:%d", len, inet_ntop(r->sin6_family, (void *)&r->sin6_addr, rip, 200), ntohs(r->sin6_port));
-			if (r->sin6_port)
-				sendto(fdudp[index], buf, len, 0, (struct sockaddr *)&remote_addr[index], sizeof(struct sockaddr_storage));
-		}
-	} else
-		write(fdudp[index], buf, len);
+			if (r->sin6_port == 0)
+				return;
+		} else
+			return;
+	}
+	if (nat[index] || (udp_shards > 1)) {	// unconnected socket
+		msg.msg_name = (void *)&remote_addr[index];
+		msg.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+	PCAP_TAP(PCAP_ENC, buf, len);
+	ret = sendmsg(fdudps[index][udp_shard], &msg, 0);
+	stat_send(ret, 1, len + tun_hdr_len, index);
+	TRACE(TR_UDP_TX, len, index);
 }
 
-void send_keepalive_to_udp(void)	// send keepalive to remote  
-{
-	u_int8_t buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-	u_int8_t *pbuf;
-	int len;
-	static u_int32_t lasttm;
-	while (1) {
-		if (got_signal || (myticket >= lasttm + 3600)) {	// log ping/pong every hour
-			err_msg("============= myticket=%lu, master_slave=%d, master_status=%d, slave_status=%d", (unsigned long)myticket,
-				master_slave, master_status, slave_status);
-			err_msg("master ping_send/pong_recv: %d/%d, ping_recv/pong_send: %d/%d",
-				(unsigned long)ping_send[MASTER], (unsigned long)pong_recv[MASTER], (unsigned long)ping_recv[MASTER],
-				(unsigned long)pong_send[MASTER]);
-			err_msg(" slave ping_send/pong_recv: %d/%d, ping_recv/pong_send: %d/%d", (unsigned long)ping_send[SLAVE],
-				(unsigned long)pong_recv[SLAVE], (unsigned long)ping_recv[SLAVE], (unsigned long)pong_send[SLAVE]);
-			if (myticket >= lasttm + 3600) {
-				ping_send[MASTER] = ping_send[SLAVE] = ping_recv[MASTER] = ping_recv[SLAVE] = 0;
-				pong_send[MASTER] = pong_send[SLAVE] = pong_recv[MASTER] = pong_recv[SLAVE] = 0;
-				lasttm = myticket;
-			}
-			got_signal = 0;
-		}
-		myticket++;
-		if (mypassword[0]) {
-			if (nat[MASTER] == 0) {
-				len = snprintf((char *)buf, MAX_PACKET_SIZE, "PASSWORD:%s", mypassword);
-				Debug("send password: %s", buf);
-				len++;
-				if (enc_key_len > 0) {
-					len = do_encrypt((u_int8_t *) buf, len, nbuf);
-					pbuf = nbuf;
-				} else
-					pbuf = buf;
-				send_udp_to_remote(pbuf, len, MASTER);	// send to master
-			}
-			if (master_slave && (nat[SLAVE] == 0))
-				send_udp_to_remote(pbuf, len, SLAVE);	// send to slave
-		}
-		memcpy(buf, "PING:PING:", 10);
-		len = 10;
-		if (enc_key_len > 0) {
-			len = do_encrypt((u_int8_t *) buf, len, nbuf);
-			pbuf = nbuf;
-		} else
-			pbuf = buf;
-		send_udp_to_remote(pbuf, len, MASTER);	// send to master
-		ping_send[MASTER]++;
+/* preallocated packet buffers for recvmmsg/sendmmsg, one per thread */
+struct pkt_batch {
+	int size, cnt;
+	int index;		// sendmmsg: all queued packets go to fdudp[index]
+	struct timespec start;	// sendmmsg: when the first packet was queued
+	struct pkt_batch *slave;	// -mp: packets to slave, this batch keeps master's. NULL: flush when index changes
+	struct pkt_batch *cur;	// batch of the last batch_next()
+	int buf_size;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_storage *addrs;
+	u_int8_t *bufs;
+	struct mmsghdr *gso_msgs;	// UDP_SEGMENT: one msg per run of same size packets
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} *ctrls;		// UDP_SEGMENT/UDP_GRO cmsg
+};
 
-		if (master_status == STATUS_OK) {	// now master is OK
-			if (myticket > last_pong[MASTER] + 5) {	// master OK->BAD
-				master_status = STATUS_BAD;
-				if (master_slave)
-					current_remote = SLAVE;	// switch to SLAVE
-				err_msg("master OK-->BAD, current_remote is %d", current_remote);
-			}
-		} else {	// now master is BAD
-			if (myticket < last_pong[MASTER] + 4) {	// master BAD->OK
-				master_status = STATUS_OK;
-				current_remote = MASTER;	// switch to MASTER
-				err_msg("master BAD-->OK, current_remote is %d", current_remote);
-			}
-		}
+#define BATCH_BUF_SIZE	(MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH + TUN_HDR_MAX)
+#define GRO_BUF_SIZE	65536
+#define GSO_MAX_SEGS	64	// UDP_MAX_SEGMENTS of old kernel
+#define GSO_MAX_BYTES	60000
 
-		if (master_slave) {
-			send_udp_to_remote(pbuf, len, SLAVE);	// send to slave
-			ping_send[SLAVE]++;
+int gso_max_size = 65535;	// packets larger than this failed UDP_SEGMENT, send them one by one, atomic
 
-			if (slave_status == STATUS_OK) {	// now slave is OK
-				if (myticket > last_pong[SLAVE] + 5) {	// slave OK->BAD
-					slave_status = STATUS_BAD;
-					err_msg("slave OK-->BAD");
-				}
-			} else {	// now slave is BAD
-				if (myticket < last_pong[SLAVE] + 4) {	// slave BAD->OK
-					slave_status = STATUS_OK;
-					err_msg("slave BAD-->OK");
-				}
-			}
-		}
-		sleep(1);
+struct pkt_batch *batch_alloc(int size, int buf_size)
+{
+	struct pkt_batch *b;
+	int i;
+
+	b = calloc(1, sizeof(struct pkt_batch));
+	if (b == NULL)
+		err_sys("malloc batch");
+	b->size = size;
+	b->buf_size = buf_size;
+	b->msgs = calloc(size, sizeof(struct mmsghdr));
+	b->iovs = calloc(size, sizeof(struct iovec));
+	b->addrs = calloc(size, sizeof(struct sockaddr_storage));
+	b->bufs = malloc((size_t)size * buf_size);
+	b->gso_msgs = calloc(size, sizeof(struct mmsghdr));
+	b->ctrls = calloc(size, sizeof(b->ctrls[0]));
+	if ((b->msgs == NULL) || (b->iovs == NULL) || (b->addrs == NULL) || (b->bufs == NULL) || (b->gso_msgs == NULL)
+	    || (b->ctrls == NULL))
+		err_sys("malloc batch");
+	for (i = 0; i < size; i++) {
+		b->iovs[i].iov_base = b->bufs + (size_t)i * buf_size;
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
 	}
+	b->cur = b;
+	return b;
 }
 
-void process_raw_to_udp(void)	// used by mode==0 & mode==1
+/* send batch of a reader thread, -mp alternates master and slave, so keep a batch for each path */
+struct pkt_batch *tx_batch_alloc(void)
 {
-	u_int8_t buf[MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH];
-	u_int8_t nbuf[MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH];
-	u_int8_t *pbuf;
-	int len;
-	int offset = 0;
-
-	while (1) {		// read from eth rawsocket
-		if (mode == MODEE) {
-#ifdef HAVE_PACKET_AUXDATA
-			struct sockaddr from;
-			struct iovec iov;
-			struct msghdr msg;
-			struct cmsghdr *cmsg;
-			union {
-				struct cmsghdr cmsg;
-				char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
-			} cmsg_buf;
-			msg.msg_name = &from;
-			msg.msg_namelen = sizeof(from);
-			msg.msg_iov = &iov;
-			msg.msg_iovlen = 1;
-			msg.msg_control = &cmsg_buf;
-			msg.msg_controllen = sizeof(cmsg_buf);
-			msg.msg_flags = 0;
-
-			offset = VLAN_TAG_LEN;
-			iov.iov_len = MAX_PACKET_SIZE;
-			iov.iov_base = buf + offset;
-			len = recvmsg(fdraw, &msg, MSG_TRUNC);
-			if (len <= 0)
-				continue;
-			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-				struct tpacket_auxdata *aux;
-				struct vlan_tag *tag;
+	struct pkt_batch *b = batch_alloc(batch_size, BATCH_BUF_SIZE);
+	if (multipath)
+		b->slave = batch_alloc(batch_size, BATCH_BUF_SIZE);
+	return b;
+}
 
-				if (cmsg->cmsg_len < CMSG_LEN(sizeof(struct tpacket_auxdata))
-				    || cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA)
-					continue;
+long elapsed_usec(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
 
-				aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
+int batch_bytes(struct iovec *iov, int n)
+{
+	int i, bytes = 0;
+	for (i = 0; i < n; i++)
+		bytes += iov[i].iov_len;
+	return bytes;
+}
 
-#if defined(TP_STATUS_VLAN_VALID)
-				if ((aux->tp_vlan_tci == 0)
-				    && !(aux->tp_status & TP_STATUS_VLAN_VALID))
+/* send runs of same size packets as one UDP_SEGMENT super packet, the last one of run may be shorter */
+void batch_flush_gso(struct pkt_batch *b)
+{
+	int i = 0, j, runs = 0, n, size, total, old, max_size = __atomic_load_n(&gso_max_size, __ATOMIC_RELAXED);
+	struct msghdr *m;
+	struct cmsghdr *cm;
+
+	while (i < b->cnt) {
+		size = total = b->iovs[i].iov_len;
+		for (j = i + 1; (size <= max_size) && (j < b->cnt) && (j - i < GSO_MAX_SEGS) && (total + b->iovs[j].iov_len <= GSO_MAX_BYTES); j++) {
+			if (b->iovs[j].iov_len > size)
+				break;
+			total += b->iovs[j].iov_len;
+			if (b->iovs[j].iov_len < size) {
+				j++;
+				break;
+			}
+		}
+		m = &b->gso_msgs[runs].msg_hdr;
+		m->msg_name = b->msgs[i].msg_hdr.msg_name;
+		m->msg_namelen = b->msgs[i].msg_hdr.msg_namelen;
+		m->msg_iov = &b->iovs[i];
+		m->msg_iovlen = j - i;
+		m->msg_control = NULL;
+		m->msg_controllen = 0;
+		if (j - i > 1) {
+			m->msg_control = &b->ctrls[runs];
+			m->msg_controllen = CMSG_SPACE(sizeof(u_int16_t));
+			cm = CMSG_FIRSTHDR(m);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+			*(u_int16_t *) CMSG_DATA(cm) = size;
+		}
+		runs++;
+		i = j;
+	}
+
+	i = 0;
+	while (i < runs) {
+		n = sendmmsg(fdudps[b->index][udp_shard], b->gso_msgs + i, runs - i, 0);
+		if (n > 0) {
+			for (j = i; j < i + n; j++)
+				stat_send(0, b->gso_msgs[j].msg_hdr.msg_iovlen, batch_bytes(b->gso_msgs[j].msg_hdr.msg_iov, b->gso_msgs[j].msg_hdr.msg_iovlen), b->index);
+			i += n;
+			continue;
+		}
+		stat_send(-1, 0, 0, b->index);
+		m = &b->gso_msgs[i].msg_hdr;
+		if ((m->msg_iovlen > 1) && ((errno == EINVAL) || (errno == EIO) || (errno == EMSGSIZE))) {	// no gso support, or larger than mtu
+			j = m->msg_iov - b->iovs;
+			old = __atomic_load_n(&gso_max_size, __ATOMIC_RELAXED);	// only lower it, other threads may too
+			while ((old > (int)b->iovs[j].iov_len - 1)
+			       && !__atomic_compare_exchange_n(&gso_max_size, &old, b->iovs[j].iov_len - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+			TRACE(TR_GSO_FALLBACK, m->msg_iovlen, b->iovs[j].iov_len - 1);
+			Debug("udp gso send error: %s, send %d packets one by one, gso_max_size=%d", strerror(errno), (int)m->msg_iovlen,
+			      (int)b->iovs[j].iov_len - 1);
+			n = sendmmsg(fdudps[b->index][udp_shard], b->msgs + j, m->msg_iovlen, 0);
+			stat_send(n, n, n > 0 ? batch_bytes(b->iovs + j, n) : 0, b->index);
+		} else
+			Debug("sendmmsg error: %s", strerror(errno));
+		i++;		// drop this one
+	}
+	b->cnt = 0;
+}
+
+void batch_flush(struct pkt_batch *b)
+{
+	int i = 0, n;
+	TRACE(TR_BATCH_FLUSH, b->cnt, b->index);
+	if (udp_gso) {
+		batch_flush_gso(b);
+		return;
+	}
+	while (i < b->cnt) {
+		n = sendmmsg(fdudps[b->index][udp_shard], b->msgs + i, b->cnt - i, 0);
+		if (n <= 0) {
+			stat_send(-1, 0, 0, b->index);
+			Debug("sendmmsg %d packets error: %s", b->cnt - i, strerror(errno));
+			break;	// drop the rest
+		}
+		stat_send(n, n, batch_bytes(b->iovs + i, n), b->index);
+		i += n;
+	}
+	b->cnt = 0;
+}
+
+/* return the buffer for next packet to fdudp[index], fill it and call batch_queue() */
+u_int8_t *batch_next(struct pkt_batch *b, int index)
+{
+	struct pkt_batch *p = b;
+
+	if (b->slave && (index == SLAVE))
+		p = b->slave;
+	else if (b->cnt && (b->index != index))
+		batch_flush(b);
+	b->cur = p;
+	p->index = index;
+	return p->bufs + (size_t)p->cnt * p->buf_size + tun_hdr_len;	// room for tunnel header
+}
+
+/* queue the packet in batch_next() buffer, flush if batch is full */
+void batch_queue(struct pkt_batch *b, int len)
+{
+	struct msghdr *msg;
+	int index;
+
+	b = b->cur;
+	msg = &b->msgs[b->cnt].msg_hdr;
+	index = b->index;
+
+	if (len <= 0)
+		return;
+	if (tun_hdr_len) {
+		tx_hdr_take(b->bufs + (size_t)b->cnt * b->buf_size);
+		len += tun_hdr_len;
+	}
+	msg->msg_name = NULL;
+	msg->msg_namelen = 0;
+	if (nat[index] || (udp_shards > 1)) {
+		if (((remote_addr[index].ss_family == AF_INET) && (((struct sockaddr_in *)&remote_addr[index])->sin_port == 0))
+		    || ((remote_addr[index].ss_family == AF_INET6) && (((struct sockaddr_in6 *)&remote_addr[index])->sin6_port == 0)))
+			return;	// do not know remote port
+		memcpy(&b->addrs[b->cnt], (void *)&remote_addr[index], sizeof(struct sockaddr_storage));
+		msg->msg_name = &b->addrs[b->cnt];
+		msg->msg_namelen = sizeof(struct sockaddr_storage);
+	}
+	PCAP_TAP(PCAP_ENC, b->bufs + (size_t)b->cnt * b->buf_size + tun_hdr_len, len - tun_hdr_len);
+	b->iovs[b->cnt].iov_len = len;
+	if (b->cnt == 0)
+		clock_gettime(CLOCK_MONOTONIC, &b->start);
+	b->cnt++;
+	if (b->cnt == b->size)
+		batch_flush(b);
+}
+
+/* usec since the first queued packet of b and its slave batch, -1 if both are empty */
+long batch_age(struct pkt_batch *b)
+{
+	long usec = b->cnt ? elapsed_usec(&b->start) : -1;
+	if (b->slave && b->slave->cnt)
+		usec = max(usec, elapsed_usec(&b->slave->start));
+	return usec;
+}
+
+void batch_flush_all(struct pkt_batch *b)
+{
+	if (b->cnt)
+		batch_flush(b);
+	if (b->slave && b->slave->cnt)
+		batch_flush(b->slave);
+}
+
+/* wait until fd is readable, usec < 0 wait forever, return 0 if timeout */
+int wait_readable(int fd, long usec)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (usec < 0)
+		return ppoll(&pfd, 1, NULL, NULL);
+	ts.tv_sec = usec / 1000000L;
+	ts.tv_nsec = (usec % 1000000L) * 1000;
+	return ppoll(&pfd, 1, &ts, NULL);
+}
+
+/* worker threads fed by SPSC rings, used by crypto worker pool(-cw n) and software rss(-rss n)
+ *
+ * crypto pool: every reader thread (raw->udp and udp->raw) owns n workers.
+ * slot [tail, done) is finished, [done, head) waits for the worker, the rest is free.
+ * reader puts packet seq to worker seq % n and collects in the same order,
+ * so packets leave in the order they came in.
+ *
+ * rss: reader puts packet to worker flow_hash % n, the worker does the rest of work and
+ * the slot is free again when done moves on. packets of one flow stay on one worker.
+ */
+#define CW_RING_SIZE	256
+#define CW_SPIN		2000
+
+struct cw_slot {
+	int len, index;
+	int seg;		// rss: tx_seg of the frame, decrypt: raw_seg
+	int flags;		// encrypt: tx_flags, decrypt: TUN_F_* of tunnel header
+	u_int32_t seq;		// decrypt: -mp packet sequence
+	u_int8_t hdr[TUN_HDR_MAX];	// tunnel header, AEAD AAD
+	u_int8_t *out;		// result, buf or nbuf
+	int has_rmt;
+	socklen_t sock_len;
+	struct sockaddr_storage rmt;
+	u_int8_t buf[BATCH_BUF_SIZE];
+	u_int8_t nbuf[BATCH_BUF_SIZE];
+};
+
+struct cw_ring {
+	u_int32_t head __attribute__ ((aligned(64)));	// written by reader
+	int sleeping;
+	u_int32_t done __attribute__ ((aligned(64)));	// written by worker
+	u_int32_t tail __attribute__ ((aligned(64)));	// reader only
+	long id;
+	void (*init) (struct cw_ring * r);	// called once in worker thread
+	void (*work) (struct cw_ring * r, struct cw_slot * s);
+	void (*idle) (struct cw_ring * r);	// ring is empty
+	struct cw_slot *slots;
+};
+
+struct cw_pool {
+	int n;
+	u_int32_t seq_in, seq_out;
+	struct cw_ring *rings;
+	void (*done) (struct cw_pool * p, struct cw_slot * s);	// called by reader in packet order
+	struct pkt_batch *b;
+	u_int8_t nbuf[BATCH_BUF_SIZE];
+};
+
+__thread struct cw_pool *cw_pool;	// crypto pool of this reader thread
+__thread struct cw_pool *rss_pool;	// rss pool of this reader thread
+int cw_spin = CW_SPIN;		// busy wait before sleep/yield, 0 on single cpu
+
+void cw_worker(struct cw_ring *r)
+{
+	u_int32_t d, h;
+	int spin = 0;
+
+	if (r->init)
+		r->init(r);
+	while (1) {
+		d = r->done;
+		h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (d == h) {
+			if ((spin == 0) && r->idle)
+				r->idle(r);
+			if (++spin < cw_spin) {
+				cpu_relax();
+				continue;
+			}
+			__atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == h)
+				syscall(SYS_futex, &r->head, FUTEX_WAIT_PRIVATE, h, NULL, NULL, 0);
+			__atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+			spin = 0;
+			continue;
+		}
+		spin = 0;
+		r->work(r, &r->slots[d % CW_RING_SIZE]);
+		__atomic_store_n(&r->done, d + 1, __ATOMIC_RELEASE);
+	}
+}
+
+void cw_encrypt(struct cw_ring *r, struct cw_slot *s)
+{
+	s->out = enc_inplace ? s->buf : s->nbuf;
+	enc_aad = s->hdr;	// built by reader in encap_send()
+	enc_aad_len = tun_hdr_len;
+	s->len = encrypt_func(s->buf, s->len, s->out);
+}
+
+void cw_decrypt(struct cw_ring *r, struct cw_slot *s)
+{
+	s->out = enc_inplace ? s->buf : s->nbuf;
+	s->len = do_decrypt(s->buf, s->len, s->out, s->hdr);
+	if (s->len <= 0) {
+		stat_add(ST_DECRYPT_FAIL, 1);
+		TRACE(TR_DECRYPT_FAIL, 0, s->index);
+	}
+}
+
+/* start n workers for this thread */
+struct cw_pool *cw_start(int n, void (*init) (struct cw_ring * r), void (*work) (struct cw_ring * r, struct cw_slot * s),
+			 void (*idle) (struct cw_ring * r))
+{
+	struct cw_pool *p;
+	pthread_t tid;
+	int i;
+
+	p = calloc(1, sizeof(struct cw_pool));
+	if (p == NULL)
+		err_sys("malloc worker pool");
+	if (posix_memalign((void **)&p->rings, 64, n * sizeof(struct cw_ring)) != 0)
+		err_sys("malloc worker rings");
+	memset(p->rings, 0, n * sizeof(struct cw_ring));
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		cw_spin = 0;
+	p->n = n;
+	for (i = 0; i < n; i++) {
+		p->rings[i].id = i;
+		p->rings[i].init = init;
+		p->rings[i].work = work;
+		p->rings[i].idle = idle;
+		p->rings[i].slots = malloc(CW_RING_SIZE * sizeof(struct cw_slot));
+		if (p->rings[i].slots == NULL)
+			err_sys("malloc worker slots");
+		if (pthread_create(&tid, NULL, (void *)cw_worker, (void *)&p->rings[i]) != 0)
+			err_sys("pthread_create worker");
+	}
+	return p;
+}
+
+void cw_wait(int *spin)
+{
+	if (++*spin < cw_spin)
+		cpu_relax();
+	else
+		sched_yield();
+}
+
+/* hand finished packets to p->done in order, wait 1: until all submitted packets are done */
+void cw_collect(struct cw_pool *p, int wait)
+{
+	struct cw_ring *r;
+	struct cw_slot *s;
+	int spin = 0;
+
+	while (p->seq_out != p->seq_in) {
+		r = &p->rings[p->seq_out % p->n];
+		if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) == r->tail) {
+			if (!wait)
+				return;
+			cw_wait(&spin);
+			continue;
+		}
+		spin = 0;
+		s = &r->slots[r->tail % CW_RING_SIZE];
+		if (s->len > 0)
+			p->done(p, s);
+		r->tail++;
+		p->seq_out++;
+	}
+}
+
+/* free slot for next packet, fill it and call cw_submit() */
+struct cw_slot *cw_next(struct cw_pool *p)
+{
+	struct cw_ring *r = &p->rings[p->seq_in % p->n];
+	int spin = 0;
+	while (r->head - r->tail == CW_RING_SIZE) {	// ring full, finish the oldest ones
+		cw_collect(p, 0);
+		if (r->head - r->tail < CW_RING_SIZE)
+			break;
+		cw_wait(&spin);
+	}
+	return &r->slots[r->head % CW_RING_SIZE];
+}
+
+void cw_ring_submit(struct cw_ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &r->head, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void cw_submit(struct cw_pool *p)
+{
+	cw_ring_submit(&p->rings[p->seq_in % p->n]);
+	p->seq_in++;
+}
+
+/* Bob Jenkins' lookup3 final mix, as linux jhash_3words() */
+#define rol32(x, k)	(((x) << (k)) | ((x) >> (32 - (k))))
+u_int32_t jhash_3words(u_int32_t a, u_int32_t b, u_int32_t c, u_int32_t initval)
+{
+	a += 0xdeadbeef + initval;
+	b += 0xdeadbeef + initval;
+	c += 0xdeadbeef + initval;
+	c ^= b;
+	c -= rol32(b, 14);
+	a ^= c;
+	a -= rol32(c, 11);
+	b ^= a;
+	b -= rol32(a, 25);
+	c ^= b;
+	c -= rol32(b, 16);
+	a ^= c;
+	a -= rol32(c, 4);
+	b ^= a;
+	b -= rol32(a, 14);
+	c ^= b;
+	c -= rol32(b, 24);
+	return c;
+}
+
+/* hash of inner ip addresses, protocol and tcp/udp ports, mac addresses for non ip frames */
+u_int32_t flow_hash(u_int8_t * buf, int len)
+{
+	u_int8_t *packet = buf + 12;
+	u_int32_t a, b, c = 0;
+	int l4 = -1;
+
+	if (len < 14)
+		return 0;
+	len -= 12;
+	if ((packet[0] == 0x81) && (packet[1] == 0x00) && (len >= 6)) {	// 802.1Q tag
+		packet += 4;
+		len -= 4;
+	}
+	if ((packet[0] == 0x08) && (packet[1] == 0x00) && (len >= 22)) {	// IPv4
+		struct iphdr *ip = (struct iphdr *)(packet + 2);
+		a = ip->saddr;
+		b = ip->daddr;
+		c = ip->protocol;
+		if ((ntohs(ip->frag_off) & 0x3fff) == 0)	// all fragments of one packet get same hash
+			l4 = 2 + ip->ihl * 4;
+	} else if ((packet[0] == 0x86) && (packet[1] == 0xdd) && (len >= 42)) {	// IPv6
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)(packet + 2);
+		u_int32_t *s = (u_int32_t *) & ip6->ip6_src, *d = (u_int32_t *) & ip6->ip6_dst;
+		a = s[0] ^ s[1] ^ s[2] ^ s[3];
+		b = d[0] ^ d[1] ^ d[2] ^ d[3];
+		c = ip6->ip6_nxt;
+		l4 = 42;
+	} else {
+		memcpy(&a, buf, 4);
+		memcpy(&b, buf + 6, 4);
+		c = (buf[4] << 24) | (buf[5] << 16) | (buf[10] << 8) | buf[11];
+	}
+	if ((l4 > 0) && ((c == IPPROTO_TCP) || (c == IPPROTO_UDP)) && (len >= l4 + 4)) {
+		u_int32_t ports;
+		memcpy(&ports, packet + l4, 4);
+		c ^= ports;
+	}
+	return jhash_3words(a, b, c, 0);
+}
+
+/* give packet to rss worker of its flow */
+void rss_dispatch(struct cw_pool *p, u_int32_t hash, u_int8_t * buf, int len, int index, struct sockaddr_storage *rmt,
+		  socklen_t sock_len)
+{
+	struct cw_ring *r = &p->rings[hash % p->n];
+	struct cw_slot *s;
+	int spin = 0;
+
+	if (len > BATCH_BUF_SIZE)
+		return;
+	while (r->head - __atomic_load_n(&r->done, __ATOMIC_ACQUIRE) == CW_RING_SIZE)
+		cw_wait(&spin);
+	s = &r->slots[r->head % CW_RING_SIZE];
+	memcpy(s->buf, buf, len);
+	s->len = len;
+	s->index = index;
+	s->seg = tx_seg;
+	s->has_rmt = rmt != NULL;
+	if (rmt)
+		memcpy(&s->rmt, rmt, sock_len);
+	s->sock_len = sock_len;
+	cw_ring_submit(r);
+}
+
+/* hub mode: one udp socket serves many peers, each peer is learned from its address like nat mode,
+ * frames are forwarded by a MAC learning table, broadcast and unknown unicast are flooded,
+ * but never back to the peer they came from (split horizon)
+ */
+#define HUB_MAX_PEERS	4096
+#define HUB_LOCAL	0xffff	// MAC is behind local raw socket or tap
+#define HUB_PEER_TIMEOUT	30	// seconds without packet
+#define HUB_MAC_BUCKETS	8192	// 8 entries of one cache line per bucket
+#define HUB_MAC_AGE	300	// seconds
+
+struct hub_peer {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	volatile u_int32_t last_seen;	// myticket
+	volatile int in_use;
+	u_int32_t gen;		// odd while add/remove changes the slot, lock free readers check it after reading addr
+};
+
+struct hub_peer *hub_peers;
+int hub_npeers;			// high water mark of hub_peers used
+u_int16_t *hub_addr_index;	// buckets of 8 peer + 1, 0 empty
+int hub_addr_buckets;
+pthread_mutex_t hub_lock = PTHREAD_MUTEX_INITIALIZER;	// peer add/remove
+
+/* MAC table entry is mac << 16 | peer + 1 (or HUB_LOCAL), 0 empty. Lookup reads one bucket
+ * without lock, learning threads update entries by atomic store, two threads learning the same
+ * new MAC at once may use two entries, the stale one ages out
+ */
+u_int64_t *hub_macs;
+u_int32_t *hub_mac_seen;	// myticket when entry was learned or refreshed
+
+void hub_init(void)
+{
+	hub_addr_buckets = 1;
+	while (hub_addr_buckets < hub_max)
+		hub_addr_buckets <<= 1;
+	hub_peers = calloc(hub_max, sizeof(struct hub_peer));
+	hub_addr_index = calloc(hub_addr_buckets * 8, sizeof(u_int16_t));
+	hub_mac_seen = calloc(HUB_MAC_BUCKETS * 8, sizeof(u_int32_t));
+	if ((hub_peers == NULL) || (hub_addr_index == NULL) || (hub_mac_seen == NULL)
+	    || (posix_memalign((void **)&hub_macs, 64, HUB_MAC_BUCKETS * 8 * sizeof(u_int64_t)) != 0))
+		err_sys("hub table alloc error");
+	memset(hub_macs, 0, HUB_MAC_BUCKETS * 8 * sizeof(u_int64_t));
+}
+
+static inline u_int64_t mac48(const u_int8_t * mac)
+{
+	return ((u_int64_t) mac[0] << 40) | ((u_int64_t) mac[1] << 32) | ((u_int64_t) mac[2] << 24) | ((u_int64_t) mac[3] << 16)
+	    | ((u_int64_t) mac[4] << 8) | mac[5];
+}
+
+static inline u_int64_t *hub_mac_bucket(u_int64_t m)
+{
+	return hub_macs + (jhash_3words(m >> 32, (u_int32_t) m, 0, 0) & (HUB_MAC_BUCKETS - 1)) * 8;
+}
+
+/* return peer + 1, HUB_LOCAL or 0 if unknown */
+int hub_mac_lookup(const u_int8_t * mac)
+{
+	u_int64_t m = mac48(mac), *e = hub_mac_bucket(m), v;
+	int i;
+	for (i = 0; i < 8; i++) {
+		v = __atomic_load_n(&e[i], __ATOMIC_RELAXED);
+		if (v && ((v >> 16) == m))
+			return v & 0xffff;
+	}
+	return 0;
+}
+
+/* MAC is behind peer + 1 or HUB_LOCAL, refresh it or take an empty or the oldest entry of bucket */
+void hub_mac_learn(const u_int8_t * mac, int peer)
+{
+	u_int64_t m = mac48(mac), *e = hub_mac_bucket(m), v, kv = 0, key = (m << 16) | peer;
+	u_int32_t *seen = hub_mac_seen + (e - hub_macs);
+	int i, k = -1;
+
+	if (mac[0] & 1)		// multicast source
+		return;
+	for (i = 0; i < 8; i++) {
+		v = __atomic_load_n(&e[i], __ATOMIC_RELAXED);
+		if (v && ((v >> 16) == m)) {
+			if (v != key) {	// MAC moved
+				__atomic_store_n(&e[i], key, __ATOMIC_RELAXED);
+				Debug("hub mac %012llx moved to %d", (unsigned long long)m, peer);
+			}
+			k = i;
+			break;
+		}
+		if ((k < 0) || (kv && ((v == 0) || (seen[i] < seen[k])))) {	// empty or oldest
+			k = i;
+			kv = v;
+		}
+	}
+	if (i == 8)
+		__atomic_store_n(&e[k], key, __ATOMIC_RELAXED);
+	if (seen[k] != myticket)
+		seen[k] = myticket;
+}
+
+/* forget MACs not seen for HUB_MAC_AGE seconds, or behind peer + 1 if peer != 0 */
+void hub_mac_flush(int peer)
+{
+	u_int64_t v;
+	int i;
+	for (i = 0; i < HUB_MAC_BUCKETS * 8; i++) {
+		v = __atomic_load_n(&hub_macs[i], __ATOMIC_RELAXED);
+		if (v && (peer ? ((v & 0xffff) == peer) : (myticket - hub_mac_seen[i] > HUB_MAC_AGE)))
+			__atomic_compare_exchange_n(&hub_macs[i], &v, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+static inline u_int16_t *hub_addr_bucket(struct sockaddr_storage *rmt)
+{
+	u_int32_t h;
+	if (rmt->ss_family == AF_INET6) {
+		struct sockaddr_in6 *r = (struct sockaddr_in6 *)rmt;
+		u_int32_t *a = (u_int32_t *) & r->sin6_addr;
+		h = jhash_3words(a[0] ^ a[1], a[2] ^ a[3], r->sin6_port, 0);
+	} else {
+		struct sockaddr_in *r = (struct sockaddr_in *)rmt;
+		h = jhash_3words(r->sin_addr.s_addr, r->sin_port, 0, 0);
+	}
+	return hub_addr_index + (h & (hub_addr_buckets - 1)) * 8;
+}
+
+/* copy address of peer p without lock, return 0 if the slot is free or was changed meanwhile */
+static inline int hub_peer_addr(int p, struct sockaddr_storage *addr, socklen_t * addr_len)
+{
+	struct hub_peer *hp = &hub_peers[p];
+	u_int32_t g = __atomic_load_n(&hp->gen, __ATOMIC_ACQUIRE);
+
+	if ((g & 1) || !hp->in_use)
+		return 0;
+	*addr_len = hp->addr_len;
+	if (*addr_len > sizeof(struct sockaddr_storage))
+		return 0;
+	memcpy(addr, &hp->addr, *addr_len);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&hp->gen, __ATOMIC_RELAXED) == g;
+}
+
+/* slot p is changing, call with hub_lock held, again when done */
+static inline void hub_peer_gen(int p)
+{
+	__atomic_store_n(&hub_peers[p].gen, hub_peers[p].gen + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* return peer of remote address, -1 if unknown */
+int hub_peer_find(struct sockaddr_storage *rmt, socklen_t sock_len)
+{
+	u_int16_t *b = hub_addr_bucket(rmt);
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int i, p;
+	for (i = 0; i < 8; i++) {
+		p = __atomic_load_n(&b[i], __ATOMIC_ACQUIRE) - 1;
+		if ((p >= 0) && hub_peer_addr(p, &addr, &addr_len) && (addr_len == sock_len) && (memcmp(&addr, rmt, sock_len) == 0))
+			return p;
+	}
+	return -1;
+}
+
+int hub_peer_add(struct sockaddr_storage *rmt, socklen_t sock_len)
+{
+	u_int16_t *b;
+	int i, p;
+	char rip[200];
+
+	pthread_mutex_lock(&hub_lock);
+	p = hub_peer_find(rmt, sock_len);	// added by other thread
+	if (p >= 0) {
+		pthread_mutex_unlock(&hub_lock);
+		return p;
+	}
+	b = hub_addr_bucket(rmt);
+	for (i = 0; (i < 8) && b[i]; i++) ;
+	for (p = 0; (p < hub_max) && hub_peers[p].in_use; p++) ;
+	if ((i == 8) || (p == hub_max)) {
+		pthread_mutex_unlock(&hub_lock);
+		err_msg("hub has no room for new peer");
+		return -1;
+	}
+	hub_peer_gen(p);
+	memcpy(&hub_peers[p].addr, rmt, sock_len);
+	hub_peers[p].addr_len = sock_len;
+	hub_peers[p].last_seen = myticket;
+	__atomic_store_n(&hub_peers[p].in_use, 1, __ATOMIC_RELEASE);
+	hub_peer_gen(p);
+	__atomic_store_n(&b[i], p + 1, __ATOMIC_RELEASE);
+	if (p >= hub_npeers)
+		__atomic_store_n(&hub_npeers, p + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&hub_lock);
+	if (rmt->ss_family == AF_INET) {
+		struct sockaddr_in *r = (struct sockaddr_in *)rmt;
+		err_msg("hub add peer %d %s:%d", p, inet_ntop(r->sin_family, (void *)&r->sin_addr, rip, 200), ntohs(r->sin_port));
+	} else if (rmt->ss_family == AF_INET6) {
+		struct sockaddr_in6 *r = (struct sockaddr_in6 *)rmt;
+		err_msg("hub add peer %d [%s]:%d", p, inet_ntop(r->sin6_family, (void *)&r->sin6_addr, rip, 200), ntohs(r->sin6_port));
+	}
+	return p;
+}
+
+/* called every second by keepalive thread, remove silent peers and old MACs */
+void hub_age(void)
+{
+	u_int16_t *b;
+	int p, i;
+	for (p = 0; p < hub_npeers; p++) {
+		if (!hub_peers[p].in_use || (myticket - hub_peers[p].last_seen <= HUB_PEER_TIMEOUT))
+			continue;
+		pthread_mutex_lock(&hub_lock);
+		b = hub_addr_bucket(&hub_peers[p].addr);
+		for (i = 0; i < 8; i++)
+			if (b[i] == p + 1)
+				__atomic_store_n(&b[i], 0, __ATOMIC_RELEASE);
+		hub_mac_flush(p + 1);	// before the slot can be reused by a new peer
+		hub_peer_gen(p);
+		__atomic_store_n(&hub_peers[p].in_use, 0, __ATOMIC_RELEASE);
+		hub_peer_gen(p);
+		pthread_mutex_unlock(&hub_lock);
+		err_msg("hub remove peer %d, no packet in %d seconds", p, HUB_PEER_TIMEOUT);
+	}
+	if (myticket % 10 == 0)
+		hub_mac_flush(0);
+}
+
+void hub_send(u_int8_t * buf, int len, int peer)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	if (!hub_peer_addr(peer, &addr, &addr_len))	// removed, or slot reused by a new peer
+		return;
+	PCAP_TAP(PCAP_ENC, buf, len);
+	stat_send(sendto(fdudps[MASTER][udp_shard], buf, len, 0, (struct sockaddr *)&addr, addr_len), 1, len, MASTER);
+	TRACE(TR_UDP_TX, len, peer);
+}
+
+/* forward plain frame from peer (HUB_LOCAL if from raw socket or tap) to the peer owning dst MAC,
+ * or flood to all other peers, return 1 if the frame should go to local raw socket or tap too
+ */
+int hub_forward(u_int8_t * buf, int len, int from)
+{
+	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
+	u_int8_t *pbuf = buf;
+	int to, p, n;
+
+	if (len < 14)
+		return 0;
+	hub_mac_learn(buf + 6, from);
+	to = (buf[0] & 1) ? 0 : hub_mac_lookup(buf);
+	if (to == from)		// dst is on the same side
+		return 0;
+	if (to == HUB_LOCAL)
+		return 1;
+	if (enc_key_len > 0) {	// encrypt once for all peers
+		pbuf = nbuf;
+		len = do_encrypt(buf, len, pbuf);
+	}
+	if (to) {
+		if (hub_peers[to - 1].in_use)
+			hub_send(pbuf, len, to - 1);
+		return 0;
+	}
+	n = __atomic_load_n(&hub_npeers, __ATOMIC_ACQUIRE);
+	for (p = 0; p < n; p++)
+		if ((p + 1 != from) && __atomic_load_n(&hub_peers[p].in_use, __ATOMIC_ACQUIRE))
+			hub_send(pbuf, len, p);
+	return from != HUB_LOCAL;
+}
+
+/* -mp flow|packet, send over master and slave together, mp_split/256 of flows or packets go to master.
+ * keepalive thread sets mp_split every second by RTT (timestamp in PING echoed by PONG) and loss of pings
+ */
+#define MP_FLOW		1
+#define MP_PACKET	2
+
+volatile int mp_split = 128;
+volatile u_int64_t mp_srtt[2];	// ns
+int mp_loss[2];			// 1/1024, ewma of lost pings
+
+void mp_update(void)
+{
+	u_int64_t w[2];
+	int i;
+
+	for (i = MASTER; i <= SLAVE; i++) {
+		mp_loss[i] -= mp_loss[i] / 8;
+		if (last_pong[i] + 1 < myticket)	// no pong of last ping
+			mp_loss[i] += 128;
+		w[i] = (u_int64_t) (1024 - mp_loss[i]) * (1024 - mp_loss[i]) * 1000 / (mp_srtt[i] / 1000 + 100);
+	}
+	if (master_status != STATUS_OK)
+		w[MASTER] = 0;
+	if (slave_status != STATUS_OK)
+		w[SLAVE] = 0;
+	if (w[MASTER] + w[SLAVE] == 0)
+		mp_split = current_remote == MASTER ? 256 : 0;
+	else
+		mp_split = w[MASTER] * 256 / (w[MASTER] + w[SLAVE]);
+}
+
+/* remote index of the frame */
+int mp_pick(u_int8_t * buf, int len)
+{
+	static __thread int acc;
+
+	if (multipath == MP_FLOW)
+		return (flow_hash(buf, len) & 0xff) < mp_split ? MASTER : SLAVE;
+	if (multipath == MP_PACKET) {	// weighted round robin
+		acc += mp_split;
+		if (acc < 256)
+			return SLAVE;
+		acc -= 256;
+		return MASTER;
+	}
+	return current_remote;
+}
+
+/* -pmtud, the keepalive thread probes path MTU to master and slave separately: udp packets with DF set,
+ * "PMTU:" and probe size as payload, remote answers "PMTUACK:" and the size.
+ * the first search starts with the socket IP_MTU as path mtu and probes it first, if that fails falls back to
+ * pmtu_min and binary searches one probe a second. then check the result every PMTU_CHECK seconds, search again
+ * if two checks fail or after PMTU_REPROBE seconds. the result sets frag_size and MSS clamp
+ */
+#define PMTU_CHECK	10
+#define PMTU_REPROBE	600
+
+struct pmtud_state {
+	int lo, hi;		// lo is known good
+	int probe;		// size of probe in flight, 0 none
+	volatile int acked;	// last size acked by remote
+	int fails;		// failed checks
+	u_int32_t next, reprobe;	// myticket of next check and next search
+} pmtud_st[2];
+
+void set_frag_size(int index);
+
+int pmtu_min(int index)
+{
+	return transfamily[index] == PF_INET6 ? 1280 : 576;
+}
+
+void set_pmtu(int index, int mtu)
+{
+	if (mtu != pmtu[index])
+		err_msg("%s path mtu %d --> %d", index == MASTER ? "master" : "slave", pmtu[index], mtu);
+	pmtu[index] = mtu;
+	set_frag_size(index);
+}
+
+void pmtud_search(int index)
+{
+	struct pmtud_state *p = &pmtud_st[index];
+	socklen_t ln = sizeof(p->hi);
+	int r;
+
+	p->hi = path_mtu ? path_mtu : 1500;
+	if (transfamily[index] == PF_INET6)
+		r = getsockopt(fdudps[index][0], IPPROTO_IPV6, IPV6_MTU, &p->hi, &ln);
+	else
+		r = getsockopt(fdudps[index][0], IPPROTO_IP, IP_MTU, &p->hi, &ln);	// only for connected socket
+	if ((r == 0) && path_mtu)
+		p->hi = min(p->hi, path_mtu);
+	p->hi = min(p->hi, MAX_PACKET_SIZE + (transfamily[index] == PF_INET6 ? 48 : 28));
+	p->lo = pmtu_min(index);
+	p->hi = max(p->hi, p->lo);
+	p->fails = 0;
+	p->reprobe = myticket + PMTU_REPROBE;
+	if (p->lo == p->hi)
+		set_pmtu(index, p->lo);
+	Debug("pmtud search %d %d-%d", index, p->lo, p->hi);
+}
+
+/* set DF on the udp sockets, packets are never longer than frag_size */
+void pmtud_init(int index)
+{
+	int v, s;
+
+	for (s = 0; s < udp_shards; s++) {
+		if (transfamily[index] == PF_INET6) {
+			v = IPV6_PMTUDISC_PROBE;
+			if (setsockopt(fdudps[index][s], IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v, sizeof(v)) == -1)
+				err_sys("setsockopt(ipv6_mtu_discover)");
+		} else {
+			v = IP_PMTUDISC_PROBE;
+			if (setsockopt(fdudps[index][s], IPPROTO_IP, IP_MTU_DISCOVER, &v, sizeof(v)) == -1)
+				err_sys("setsockopt(ip_mtu_discover)");
+		}
+	}
+	pmtud_search(index);
+	set_pmtu(index, pmtud_st[index].hi);	// use the guess until a probe fails
+}
+
+void pmtud_send(int index, int size)
+{
+	u_int8_t buf[MAX_PACKET_SIZE];
+	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
+	int len = size - (transfamily[index] == PF_INET6 ? 48 : 28) - tun_hdr_len - enc_overhead();
+	u_int16_t n = htons(size);
+
+	memset(buf, 0, len);
+	memcpy(buf, "PMTU:", 5);
+	memcpy(buf + 5, &n, 2);
+	if (enc_key_len > 0)
+		send_udp_to_remote(nbuf, do_encrypt(buf, len, nbuf), index);
+	else
+		send_udp_to_remote(buf, len, index);
+}
+
+/* called every second by keepalive thread, check the last probe and send next */
+void pmtud_tick(int index)
+{
+	struct pmtud_state *p = &pmtud_st[index];
+	int ok;
+
+	if (p->probe) {
+		ok = p->acked == p->probe;
+		if (p->lo < p->hi) {	// searching
+			if (ok)
+				p->lo = p->probe;
+			else {
+				p->hi = p->probe - 1;
+				if (pmtu[index] > p->hi)	// in use but too large, fragment to known good
+					set_pmtu(index, p->lo);
+			}
+			if (p->lo == p->hi) {
+				set_pmtu(index, p->lo);
+				p->next = myticket + PMTU_CHECK;
+			}
+		} else if (ok)
+			p->fails = 0;
+		else if (++p->fails >= 2) {	// path mtu decreased
+			set_pmtu(index, pmtu_min(index));
+			pmtud_search(index);
+		}
+		p->probe = 0;
+	}
+	if ((p->lo == p->hi) && (myticket >= p->reprobe))
+		pmtud_search(index);
+	if (p->lo < p->hi)
+		p->probe = pmtu[index] == p->hi ? p->hi : (p->lo + p->hi + 1) / 2;	// check the size in use first
+	else if (myticket >= p->next) {
+		p->probe = p->lo;
+		p->next = myticket + PMTU_CHECK;
+	}
+	if (p->probe) {
+		p->acked = 0;
+		pmtud_send(index, p->probe);
+	}
+}
+
+void send_keepalive_to_udp(void)	// send keepalive to remote  
+{
+	u_int8_t buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
+	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
+	u_int8_t *pbuf;
+	int len;
+	static u_int32_t lasttm;
+	while (1) {
+		if (got_signal || (myticket >= lasttm + 3600)) {	// log ping/pong every hour
+			err_msg("============= myticket=%lu, master_slave=%d, master_status=%d, slave_status=%d", (unsigned long)myticket,
+				master_slave, master_status, slave_status);
+			err_msg("master ping_send/pong_recv: %d/%d, ping_recv/pong_send: %d/%d",
+				(unsigned long)ping_send[MASTER], (unsigned long)pong_recv[MASTER], (unsigned long)ping_recv[MASTER],
+				(unsigned long)pong_send[MASTER]);
+			err_msg(" slave ping_send/pong_recv: %d/%d, ping_recv/pong_send: %d/%d", (unsigned long)ping_send[SLAVE],
+				(unsigned long)pong_recv[SLAVE], (unsigned long)ping_recv[SLAVE], (unsigned long)pong_send[SLAVE]);
+			if (myticket >= lasttm + 3600) {
+				ping_send[MASTER] = ping_send[SLAVE] = ping_recv[MASTER] = ping_recv[SLAVE] = 0;
+				pong_send[MASTER] = pong_send[SLAVE] = pong_recv[MASTER] = pong_recv[SLAVE] = 0;
+				lasttm = myticket;
+			}
+			got_signal = 0;
+		}
+		myticket++;
+		if (hub_max) {	// peers ping hub, hub does not ping them
+			hub_age();
+			sleep(1);
+			continue;
+		}
+		if (mypassword[0]) {
+			if (nat[MASTER] == 0) {
+				len = snprintf((char *)buf, MAX_PACKET_SIZE, "PASSWORD:%s", mypassword);
+				Debug("send password: %s", buf);
+				len++;
+				if (enc_key_len > 0) {
+					len = do_encrypt((u_int8_t *) buf, len, nbuf);
+					pbuf = nbuf;
+				} else
+					pbuf = buf;
+				send_udp_to_remote(pbuf, len, MASTER);	// send to master
+			}
+			if (master_slave && (nat[SLAVE] == 0))
+				send_udp_to_remote(pbuf, len, SLAVE);	// send to slave
+		}
+		if (multipath)
+			mp_update();
+		memcpy(buf, "PING:PING:", 10);
+		len = 10;
+		if (multipath) {	// timestamp for rtt, echoed by pong
+			u_int64_t ts = now_ns();
+			memcpy(buf + 10, &ts, 8);
+			len = 18;
+		}
+		if (enc_key_len > 0) {
+			len = do_encrypt((u_int8_t *) buf, len, nbuf);
+			pbuf = nbuf;
+		} else
+			pbuf = buf;
+		send_udp_to_remote(pbuf, len, MASTER);	// send to master
+		ping_send[MASTER]++;
+		if (pmtud)
+			pmtud_tick(MASTER);
+
+		if (master_status == STATUS_OK) {	// now master is OK
+			if (myticket > last_pong[MASTER] + 5) {	// master OK->BAD
+				master_status = STATUS_BAD;
+				if (master_slave)
+					current_remote = SLAVE;	// switch to SLAVE
+				err_msg("master OK-->BAD, current_remote is %d", current_remote);
+			}
+		} else {	// now master is BAD
+			if (myticket < last_pong[MASTER] + 4) {	// master BAD->OK
+				master_status = STATUS_OK;
+				current_remote = MASTER;	// switch to MASTER
+				err_msg("master BAD-->OK, current_remote is %d", current_remote);
+			}
+		}
+
+		if (master_slave) {
+			send_udp_to_remote(pbuf, len, SLAVE);	// send to slave
+			ping_send[SLAVE]++;
+			if (pmtud)
+				pmtud_tick(SLAVE);
+
+			if (slave_status == STATUS_OK) {	// now slave is OK
+				if (myticket > last_pong[SLAVE] + 5) {	// slave OK->BAD
+					slave_status = STATUS_BAD;
+					err_msg("slave OK-->BAD");
+				}
+			} else {	// now slave is BAD
+				if (myticket < last_pong[SLAVE] + 4) {	// slave BAD->OK
+					slave_status = STATUS_OK;
+					err_msg("slave BAD-->OK");
+				}
+			}
+		}
+		sleep(1);
+	}
+}
+
+/* kernel strips the vlan tag of received frame, move MAC addr forward into the VLAN_TAG_LEN bytes
+ * before pkt and insert the tag, tpid in network order, return the new frame start
+ */
+u_int8_t *vlan_tag_insert(u_int8_t * pkt, u_int16_t tpid, u_int16_t tci)
+{
+	struct vlan_tag *tag;
+	memmove(pkt - VLAN_TAG_LEN, pkt, 12);
+	pkt -= VLAN_TAG_LEN;
+	tag = (struct vlan_tag *)(pkt + 12);
+	tag->vlan_tpid = tpid;
+	tag->vlan_tci = htons(tci);
+	return pkt;
+}
+
+/* read one packet from raw socket or tap, packet is at buf + *offset
+ * flags MSG_DONTWAIT for nonblock read of raw socket, tap fd is set O_NONBLOCK if batch enabled
+ */
+int read_raw_packet(int fd, u_int8_t * buf, int *offset, int flags)
+{
+	int len;
+
+	*offset = 0;
+	if (mode == MODEE) {
+#ifdef HAVE_PACKET_AUXDATA
+		struct sockaddr from;
+		struct iovec iov;
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		union {
+			struct cmsghdr cmsg;
+			char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+		} cmsg_buf;
+		msg.msg_name = &from;
+		msg.msg_namelen = sizeof(from);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+		msg.msg_flags = 0;
+
+		*offset = VLAN_TAG_LEN;
+		iov.iov_len = MAX_PACKET_SIZE;
+		iov.iov_base = buf + *offset;
+		len = recvmsg(fd, &msg, MSG_TRUNC | flags);
+		if (len <= 0)
+			return len;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct tpacket_auxdata *aux;
+
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(struct tpacket_auxdata))
+			    || cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA)
+				continue;
+
+			aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
+
+#if defined(TP_STATUS_VLAN_VALID)
+			if ((aux->tp_vlan_tci == 0)
+			    && !(aux->tp_status & TP_STATUS_VLAN_VALID))
 #else
-				if (aux->tp_vlan_tci == 0)	/* this is ambigious but without the */
+			if (aux->tp_vlan_tci == 0)	/* this is ambigious but without the */
 #endif
-					continue;
+				continue;
+
+			Debug("len=%d, iov_len=%d, ", len, (int)iov.iov_len);
+
+			len = len > iov.iov_len ? iov.iov_len : len;
+			if (len < 12)	// MAC_len * 2
+				break;
+			Debug("len=%d", len);
+
+			*offset = 0;
+			Debug("insert vlan id, recv len=%d", len);
+			vlan_tag_insert(buf + VLAN_TAG_LEN, 0x0081, aux->tp_vlan_tci);
+
+			/* Add the tag to the packet lengths.
+			 */
+			len += VLAN_TAG_LEN;
+			break;
+		}
+#else
+		len = recv(fd, buf, MAX_PACKET_SIZE, flags);
+#endif
+	} else if ((mode == MODEI) || (mode == MODEB))
+		len = read(fd, buf, tap_vnet ? VNET_BUF_SIZE : MAX_PACKET_SIZE);
+	else
+		len = -1;
+	return len;
+}
+
+/* -z lz4, compress frames before encryption, TUN_F_COMP in tunnel header marks compressed packets.
+ * each flow remembers how many frames in a row did not shrink, and skips 2^n - 1 frames before trying again,
+ * so encrypted or compressed traffic costs little
+ */
+#define LZ4_FLOWS	256
+#define LZ4_MIN_LEN	128	// smaller frames are sent as is
+#define LZ4_MAX_MISS	8
+
+struct lz4_flow {
+	u_int8_t miss, skip;
+};
+
+__thread struct lz4_flow lz4_flows[LZ4_FLOWS];
+__thread u_int8_t lz4_buf[MAX_PACKET_SIZE + VLAN_TAG_LEN];
+
+/* return length of compressed frame in lz4_buf, 0 if not compressed */
+int lz4_compress_frame(u_int8_t * buf, int len)
+{
+#ifdef ENABLE_LZ4
+	struct lz4_flow *f;
+	int n;
+
+	if (len < LZ4_MIN_LEN) {
+		stat_add(ST_COMP_BYPASS, 1);
+		return 0;
+	}
+	f = &lz4_flows[flow_hash(buf, len) % LZ4_FLOWS];
+	if (f->skip) {
+		f->skip--;
+		stat_add(ST_COMP_BYPASS, 1);
+		return 0;
+	}
+	n = LZ4_compress_default((char *)buf, (char *)lz4_buf, len, len - len / 16);	// must save 1/16
+	if (n <= 0) {
+		if (f->miss < LZ4_MAX_MISS)
+			f->miss++;
+		f->skip = (1 << f->miss) - 1;
+		stat_add(ST_COMP_BYPASS, 1);
+		return 0;
+	}
+	f->miss = 0;
+	stat_add(ST_COMPRESSED, 1);
+	stat_add(ST_COMP_SAVED, len - n);
+	return n;
+#else
+	return 0;
+#endif
+}
+
+/* decompress packet with TUN_F_COMP to lz4_buf, return new length, -1 if bad */
+int lz4_decompress_frame(u_int8_t ** p, int len)
+{
+#ifdef ENABLE_LZ4
+	int n = LZ4_decompress_safe((char *)*p, (char *)lz4_buf, len, sizeof(lz4_buf));
+	if (n > 0) {
+		*p = lz4_buf;
+		return n;
+	}
+#endif
+	stat_add(ST_DECOMP_FAIL, 1);
+	Debug("lz4 decompress error, drop...");
+	return -1;
+}
+
+/* -mtu n, frames that would make udp packets longer than path MTU are split into fragments,
+ * each with frag_hdr before its part of the frame, TUN_F_FRAG in tunnel header, encrypted one by one.
+ * the receiver collects them in a preallocated table of FRAG_SLOTS frames, selected by id and remote index.
+ * a frame not complete in FRAG_TIMEOUT_MS, or whose slot is taken by another frame, is dropped.
+ */
+#define FRAG_HDR_LEN	8
+#define FRAG_MAX	32	// max fragments of one frame, bits of frag_slot.mask
+#define FRAG_SLOTS	256
+#define FRAG_TIMEOUT_MS	500
+
+struct frag_hdr {
+	u_int16_t id;		// network order
+	u_int16_t total;	// frame length
+	u_int16_t off;		// offset of this part
+	u_int8_t index, count;
+};
+
+struct frag_slot {
+	pthread_mutex_t lock;
+	int used, index, seg;
+	u_int16_t id, total;
+	u_int8_t count;
+	u_int32_t mask;		// fragments received
+	struct timespec start;
+	u_int8_t buf[MAX_PACKET_SIZE];
+};
+
+struct frag_slot *frag_table;
+u_int32_t frag_next_id;
+__thread u_int8_t *frag_buf;	// fragment to send
+__thread u_int8_t *frag_out;	// frame reassembled
+
+void encap_send(u_int8_t * buf, int len, u_int8_t * nbuf, struct pkt_batch *b, int index);
+
+/* max plaintext in one udp packet to remote index */
+void set_frag_size(int index)
+{
+	frag_size[index] = pmtu[index] - (transfamily[index] == PF_INET6 ? 48 : 28) - tun_hdr_len - enc_overhead();
+	if (frag_size[index] < FRAG_HDR_LEN + MAX_PACKET_SIZE / FRAG_MAX)
+		err_quit("-mtu %d too small", pmtu[index]);
+}
+
+void frag_init(void)
+{
+	int i;
+	frag_table = calloc(FRAG_SLOTS, sizeof(struct frag_slot));
+	if (frag_table == NULL)
+		err_sys("malloc frag_table");
+	for (i = 0; i < FRAG_SLOTS; i++)
+		pthread_mutex_init(&frag_table[i].lock, NULL);
+}
+
+void frag_send(u_int8_t * buf, int len, u_int8_t * nbuf, struct pkt_batch *b, int index)
+{
+	struct frag_hdr h;
+	int flags = tx_flags;
+	int count = (len + frag_size[index] - FRAG_HDR_LEN - 1) / (frag_size[index] - FRAG_HDR_LEN);
+	int psize = (len + count - 1) / count;	// same size parts
+	int i, off;
+
+	if ((frag_buf == NULL) && ((frag_buf = malloc(FRAG_HDR_LEN + MAX_PACKET_SIZE)) == NULL))
+		err_sys("malloc frag_buf");
+	h.id = htons(__sync_fetch_and_add(&frag_next_id, 1));
+	h.total = htons(len);
+	h.count = count;
+	tx_flags = flags | TUN_F_FRAG;
+	for (i = 0; i < count; i++) {
+		off = i * psize;
+		h.off = htons(off);
+		h.index = i;
+		memcpy(frag_buf, &h, FRAG_HDR_LEN);
+		memcpy(frag_buf + FRAG_HDR_LEN, buf + off, min(psize, len - off));
+		encap_send(frag_buf, FRAG_HDR_LEN + min(psize, len - off), nbuf, b, index);
+	}
+	tx_flags = flags;
+	stat_add(ST_FRAG_TX, count);
+}
+
+/* add one fragment, return frame length and set *p if complete, or 0 */
+int frag_reasm(int index, u_int8_t ** p, int len)
+{
+	struct frag_hdr h;
+	struct frag_slot *f;
+	int off, total, ret = 0;
+
+	if ((frag_table == NULL) || (len <= FRAG_HDR_LEN)) {
+		stat_add(ST_FRAG_DROP, 1);
+		return 0;
+	}
+	memcpy(&h, *p, FRAG_HDR_LEN);
+	off = ntohs(h.off);
+	total = ntohs(h.total);
+	len -= FRAG_HDR_LEN;
+	if ((h.count < 2) || (h.count > FRAG_MAX) || (h.index >= h.count) || (total > MAX_PACKET_SIZE) || (off + len > total)) {
+		Debug("bad fragment id %d %d/%d off %d total %d", ntohs(h.id), h.index, h.count, off, total);
+		stat_add(ST_FRAG_DROP, 1);
+		return 0;
+	}
+	f = &frag_table[(ntohs(h.id) + index * (FRAG_SLOTS / 2)) % FRAG_SLOTS];
+	pthread_mutex_lock(&f->lock);
+	if (f->used && ((f->id != h.id) || (f->index != index) || (f->seg != raw_seg) || (f->total != total)
+			|| (f->count != h.count) || (elapsed_usec(&f->start) > FRAG_TIMEOUT_MS * 1000))) {
+		stat_add(ST_FRAG_DROP, 1);	// old frame not complete
+		f->used = 0;
+	}
+	if (!f->used) {
+		f->used = 1;
+		f->id = h.id;
+		f->index = index;
+		f->seg = raw_seg;
+		f->total = total;
+		f->count = h.count;
+		f->mask = 0;
+		clock_gettime(CLOCK_MONOTONIC, &f->start);
+	}
+	memcpy(f->buf + off, *p + FRAG_HDR_LEN, len);
+	f->mask |= 1U << h.index;
+	if (f->mask == (u_int32_t) ((1ULL << f->count) - 1)) {
+		if ((frag_out == NULL) && ((frag_out = malloc(MAX_PACKET_SIZE)) == NULL))
+			err_sys("malloc frag_out");
+		memcpy(frag_out, f->buf, total);
+		f->used = 0;
+		*p = frag_out;
+		ret = total;
+		stat_add(ST_FRAG_REASM, 1);
+	}
+	pthread_mutex_unlock(&f->lock);
+	return ret;
+}
+
+/* send frame or aggregate with tx_flags to fdudp[index], by crypto worker, in batch or now */
+void encap_send(u_int8_t * buf, int len, u_int8_t * nbuf, struct pkt_batch *b, int index)
+{
+	u_int8_t *pbuf;
+
+	if (frag_size[index] && (len > frag_size[index])) {
+		frag_send(buf, len, nbuf, b, index);
+		return;
+	}
+	if (cw_pool) {		// encrypt by crypto worker, sent by cw_raw_done()
+		struct cw_slot *s = cw_next(cw_pool);
+		memcpy(s->buf, buf, len);
+		s->len = len;
+		s->index = index;
+		s->flags = tx_flags;
+		if (tun_hdr_len)
+			tun_hdr_put(s->hdr, tx_flags);
+		cw_submit(cw_pool);
+		cw_collect(cw_pool, 0);
+		return;
+	}
+
+	if (b) {
+		pbuf = batch_next(b, index);
+		if (enc_key_len > 0)
+			len = do_encrypt(buf, len, pbuf);
+		else
+			memcpy(pbuf, buf, len);
+		batch_queue(b, len);
+		return;
+	}
+
+	if (enc_key_len > 0) {
+		pbuf = enc_inplace ? buf : nbuf;
+		len = do_encrypt(buf, len, pbuf);
+	} else
+		pbuf = buf;
+
+	send_udp_to_remote(pbuf, len, index);
+}
+
+/* -aggr usec, frames to the same remote and segment are packed into one udp packet of up to aggr_size bytes,
+ * each after 2 bytes length, top bit set if lz4 compressed, TUN_F_AGGR in tunnel header.
+ * the packet is encrypted once, and sent when full or aggr_usec after its first frame
+ */
+#define AGGR_F_COMP	0x8000
+#define AGGR_MIN_FRAME	60	// flush if there is no room for a frame this long
+
+struct aggr_buf {
+	int len, cnt, index, seg;
+	struct timespec start;
+	u_int8_t nbuf[BATCH_BUF_SIZE];
+	u_int8_t buf[MAX_PACKET_SIZE];
+};
+
+__thread struct aggr_buf *aggr;
+
+void aggr_flush(struct pkt_batch *b)
+{
+	struct aggr_buf *a = aggr;
+	int seg = tx_seg;
+	u_int16_t l;
+
+	if ((a == NULL) || (a->cnt == 0))
+		return;
+	tx_seg = a->seg;
+	if (a->cnt == 1) {	// send as a normal packet
+		memcpy(&l, a->buf, 2);
+		tx_flags = tx_data_flags | (ntohs(l) & AGGR_F_COMP ? TUN_F_COMP : 0);
+		encap_send(a->buf + 2, a->len - 2, a->nbuf, b, a->index);
+	} else {
+		tx_flags = tx_data_flags | TUN_F_AGGR;
+		stat_add(ST_AGGR_PKTS, 1);
+		stat_add(ST_AGGR_FRAMES, a->cnt);
+		encap_send(a->buf, a->len, a->nbuf, b, a->index);
+	}
+	a->len = a->cnt = 0;
+	tx_seg = seg;
+}
+
+void aggr_add(u_int8_t * buf, int len, int comp, u_int8_t * nbuf, struct pkt_batch *b, int index)
+{
+	struct aggr_buf *a = aggr;
+	int size = frag_size[index] ? min(aggr_size, frag_size[index]) : aggr_size;
+	u_int16_t l;
+
+	if (a == NULL) {
+		a = aggr = calloc(1, sizeof(struct aggr_buf));
+		if (a == NULL)
+			err_sys("malloc aggr");
+	}
+	if (a->cnt && ((a->index != index) || (a->seg != tx_seg) || (a->len + 2 + len > size)))
+		aggr_flush(b);
+	if (2 + len > size) {	// too long, send alone
+		tx_flags = tx_data_flags | (comp ? TUN_F_COMP : 0);
+		encap_send(buf, len, nbuf, b, index);
+		return;
+	}
+	if (a->cnt == 0) {
+		a->index = index;
+		a->seg = tx_seg;
+		clock_gettime(CLOCK_MONOTONIC, &a->start);
+	}
+	l = htons(len | (comp ? AGGR_F_COMP : 0));
+	memcpy(a->buf + a->len, &l, 2);
+	memcpy(a->buf + a->len + 2, buf, len);
+	a->len += 2 + len;
+	a->cnt++;
+	if ((a->len + 2 + AGGR_MIN_FRAME > size) || (elapsed_usec(&a->start) >= aggr_usec))
+		aggr_flush(b);
+}
+
+/* process one packet from local raw socket or tap, send to remote udp */
+void encap_packet(u_int8_t * buf, int len, u_int8_t * nbuf, struct pkt_batch *b)
+{
+	int index;
+
+	if (loopback_check && do_loopback_check(buf, len)) {
+		stat_add(ST_LOOPBACK_DROP, 1);
+		TRACE(TR_LOOPBACK_DROP, len, 0);
+		return;
+	}
+	index = mp_pick(buf, len);
+	if (!read_only && fixmss)	// read only, no fix_mss
+		fix_mss(buf, len, index);
+	if (debug)
+		printPacket((EtherPacket *) buf, len, "from local  rawsocket:");
+
+	if (hub_max) {
+		hub_forward(buf, len, HUB_LOCAL);
+		return;
+	}
+
+	tx_flags = tx_data_flags;
+	if (compress_lz4) {
+		int n = lz4_compress_frame(buf, len);
+		if (n) {
+			tx_flags |= TUN_F_COMP;
+			buf = lz4_buf;
+			len = n;
+		}
+	}
+
+	if (aggregate) {
+		aggr_add(buf, len, tx_flags & TUN_F_COMP, nbuf, b, index);
+		return;
+	}
+	encap_send(buf, len, nbuf, b, index);
+}
+
+void process_raw_packet(u_int8_t * buf, int len, u_int8_t * nbuf, struct pkt_batch *b)
+{
+	u_int64_t t0;
+
+	if (write_only)
+		return;		// write only
+	if (rss_pool) {
+		rss_dispatch(rss_pool, flow_hash(buf, len), buf, len, current_remote, NULL, 0);
+		return;
+	}
+	stat_add(ST_RAW_RX_PKTS, 1);
+	stat_add(ST_RAW_RX_BYTES, len);
+	TRACE(TR_RAW_RX, len, 0);
+	PCAP_TAP(PCAP_RAW, buf, len);
+	if (metrics_addr == NULL) {
+		encap_packet(buf, len, nbuf, b);
+		return;
+	}
+	t0 = now_ns();
+	encap_packet(buf, len, nbuf, b);
+	stat_hist(HIST_ENCAP, now_ns() - t0);
+}
 
-				Debug("len=%d, iov_len=%d, ", len, (int)iov.iov_len);
+/* encrypted packet from crypto worker */
+void cw_raw_done(struct cw_pool *p, struct cw_slot *s)
+{
+	tx_flags = s->flags;
+	memcpy(tx_hdr, s->hdr, tun_hdr_len);
+	tx_hdr_set = 1;
+	if (p->b) {
+		memcpy(batch_next(p->b, s->index), s->out, s->len);
+		batch_queue(p->b, s->len);
+	} else
+		send_udp_to_remote(s->out, s->len, s->index);
+}
 
-				len = len > iov.iov_len ? iov.iov_len : len;
-				if (len < 12)	// MAC_len * 2
-					break;
-				Debug("len=%d", len);
+/* nothing to read from fd, flush the send batch or wait */
+void raw_idle(int fd, struct pkt_batch *b)
+{
+	long usec;
 
-				memmove(buf, buf + VLAN_TAG_LEN, 12);
-				offset = 0;
+	if (aggr && aggr->cnt) {
+		usec = elapsed_usec(&aggr->start);
+		if ((usec < aggr_usec) && wait_readable(fd, aggr_usec - usec))
+			return;	// more frames to pack
+		aggr_flush(b);
+	}
+	if (cw_pool)
+		cw_collect(cw_pool, 1);
+	if (b && ((usec = batch_age(b)) >= 0)) {
+		if ((usec >= flush_usec) || (wait_readable(fd, flush_usec - usec) == 0))
+			batch_flush_all(b);
+	} else
+		wait_readable(fd, -1);
+}
 
-				/*
-				 * Now insert the tag.
-				 */
-				tag = (struct vlan_tag *)(buf + 12);
-				Debug("insert vlan id, recv len=%d", len);
-				tag->vlan_tpid = 0x0081;
-				tag->vlan_tci = htons(aux->tp_vlan_tci);
+/* mode e, read packets from TPACKET_V3 rx ring, no copy */
+void process_rx_ring_to_udp(struct pkt_batch *b)
+{
+	u_int8_t nbuf[MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH];
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *hdr;
+	u_int8_t *pkt;
+	int i, len, vlan;
 
-				/* Add the tag to the packet lengths.
-				 */
-				len += VLAN_TAG_LEN;
-				break;
+	while (1) {
+		bd = (struct tpacket_block_desc *)(rxring.map + (size_t)rxring.cur * RING_BLOCK_SIZE);
+		if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+			raw_idle(fdraw, b);
+			continue;
+		}
+		hdr = (struct tpacket3_hdr *)((u_int8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			pkt = (u_int8_t *) hdr + hdr->tp_mac;
+			len = hdr->tp_snaplen;
+			vlan = (len >= 12) && ((hdr->hv1.tp_vlan_tci != 0) || (hdr->tp_status & TP_STATUS_VLAN_VALID));
+			if (len + (vlan ? VLAN_TAG_LEN : 0) > MAX_PACKET_SIZE) {	// GRO/LRO frame, does not fit nbuf or batch buffers
+				stat_add(ST_OVERSIZE_DROP, 1);
+				hdr = (struct tpacket3_hdr *)((u_int8_t *) hdr + hdr->tp_next_offset);
+				continue;
 			}
-#else
-			len = recv(fdraw, buf, MAX_PACKET_SIZE, 0);
+			if (vlan) {
+				u_int16_t tpid = 0x0081;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+				if (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID)
+					tpid = htons(hdr->hv1.tp_vlan_tpid);
 #endif
-		} else if ((mode == MODEI) || (mode == MODEB))
-			len = read(fdraw, buf, MAX_PACKET_SIZE);
-		else
-			return;
+				// PACKET_RESERVE leaves room before the frame
+				pkt = vlan_tag_insert(pkt, tpid, hdr->hv1.tp_vlan_tci);
+				len += VLAN_TAG_LEN;
+			}
+			process_raw_packet(pkt, len, nbuf, b);
+			hdr = (struct tpacket3_hdr *)((u_int8_t *) hdr + hdr->tp_next_offset);
+		}
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		rxring.cur = (rxring.cur + 1) % rxring.block_nr;
+	}
+}
 
-		if (len <= 0)
-			continue;
-		if (write_only)
-			continue;	// write only
+void pin_thread(int q)
+{
+	cpu_set_t cpus;
+	if (cpu_count == 0)
+		return;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu_list[q % cpu_count], &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		err_msg("pin thread of queue %d to cpu %d error", q, cpu_list[q % cpu_count]);
+}
 
-		if (loopback_check && do_loopback_check(buf + offset, len))
-			continue;
-		if (!read_only && fixmss)	// read only, no fix_mss
-			fix_mss(buf + offset, len, current_remote);
-		if (debug) {
-			printPacket((EtherPacket *) (buf + offset), len, "from local  rawsocket:");
-			if (offset)
-				printf("offset=%d\n", offset);
+/* tap IFF_VNET_HDR: finish the checksum left by kernel, segment TSO super packet to gso_size packets,
+ * then process each packet
+ */
+void process_vnet_packet(u_int8_t * buf, int len, u_int8_t * seg, u_int8_t * nbuf, struct pkt_batch *b)
+{
+	struct virtio_net_hdr *vh = (struct virtio_net_hdr *)buf;
+	u_int8_t *pkt = buf + sizeof(struct virtio_net_hdr);
+	struct iphdr *ip = NULL;
+	struct ip6_hdr *ip6 = NULL;
+	struct tcphdr *tcph;
+	int l3off = 12, l4off, hdrlen, payload, off, seglen, mss, n;
+	u_int32_t seq;
+	u_int16_t ipid = 0;
+
+	len -= sizeof(struct virtio_net_hdr);
+	if (len < 14)
+		return;
+	if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE) {
+		if ((vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && (vh->csum_start + vh->csum_offset + 2 <= len)) {
+			u_int16_t *check = (u_int16_t *) (pkt + vh->csum_start + vh->csum_offset);
+			*check = csum_fold(csum_partial(pkt + vh->csum_start, len - vh->csum_start, 0));
+		}
+		if (len > MAX_PACKET_SIZE) {	// tap mtu too large, does not fit nbuf or batch buffers
+			stat_add(ST_OVERSIZE_DROP, 1);
+			return;
 		}
+		process_raw_packet(pkt, len, nbuf, b);
+		return;
+	}
 
-		if (enc_key_len > 0) {
-			len = do_encrypt((u_int8_t *) buf + offset, len, nbuf);
-			pbuf = nbuf;
-		} else
-			pbuf = buf + offset;
+	if ((pkt[l3off] == 0x81) && (pkt[l3off + 1] == 0x00))	// skip 802.1Q tag 0x8100
+		l3off += 4;
+	l3off += 2;
+	if (((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV4) && (len >= l3off + 20)) {
+		ip = (struct iphdr *)(pkt + l3off);
+		if ((ip->version != 4) || (ip->protocol != IPPROTO_TCP))
+			return;
+		l4off = l3off + ip->ihl * 4;
+		ipid = ntohs(ip->id);
+	} else if (((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV6) && (len >= l3off + 40)) {
+		ip6 = (struct ip6_hdr *)(pkt + l3off);
+		if (ip6->ip6_nxt != IPPROTO_TCP)
+			return;	// extension header is not supported
+		l4off = l3off + 40;
+	} else {
+		Debug("unsupported vnet gso_type %d", vh->gso_type);
+		return;
+	}
+	if (len < l4off + 20)
+		return;
+	tcph = (struct tcphdr *)(pkt + l4off);
+	hdrlen = l4off + tcph->doff * 4;
+	mss = vh->gso_size;
+	payload = len - hdrlen;
+	if ((mss <= 0) || (payload <= 0) || (hdrlen + mss > MAX_PACKET_SIZE))
+		return;
+	seq = ntohl(tcph->seq);
+	Debug("vnet gso packet len=%d, gso_size=%d", len, mss);
+
+	for (off = 0, n = 0; off < payload; off += seglen, n++) {
+		struct tcphdr *th = (struct tcphdr *)(seg + l4off);
+		u_int32_t sum;
+
+		seglen = payload - off > mss ? mss : payload - off;
+		memcpy(seg, pkt, hdrlen);
+		memcpy(seg + hdrlen, pkt + hdrlen + off, seglen);
+		th->seq = htonl(seq + off);
+		if (off + seglen < payload)
+			seg[l4off + 13] &= ~(TH_FIN | TH_PUSH);	// only last segment
+		if (n > 0)
+			seg[l4off + 13] &= ~0x80;	// CWR, only first segment
+		th->check = 0;
+		if (ip) {
+			struct iphdr *sip = (struct iphdr *)(seg + l3off);
+			sip->tot_len = htons(hdrlen - l3off + seglen);
+			sip->id = htons(ipid + n);
+			sip->check = 0;
+			sip->check = csum_fold(csum_partial((u_int8_t *) sip, sip->ihl * 4, 0));
+			sum = csum_partial((u_int8_t *) & sip->saddr, 8, 0);
+		} else {
+			struct ip6_hdr *sip6 = (struct ip6_hdr *)(seg + l3off);
+			sip6->ip6_plen = htons(hdrlen - l4off + seglen);
+			sum = csum_partial((u_int8_t *) & sip6->ip6_src, 32, 0);
+		}
+		sum += htons(IPPROTO_TCP) + htons(hdrlen - l4off + seglen);
+		th->check = csum_fold(csum_partial((u_int8_t *) th, hdrlen - l4off + seglen, sum));
+		process_raw_packet(seg, hdrlen + seglen, nbuf, b);
+	}
+}
+
+__thread struct pkt_batch *rss_batch;	// send batch of rss worker
+
+void rss_raw_init(struct cw_ring *r)
+{
+	udp_shard = r->id % udp_shards;
+	pin_thread(r->id);
+	if (batch_size > 1)
+		rss_batch = tx_batch_alloc();
+}
+
+void rss_raw_work(struct cw_ring *r, struct cw_slot *s)
+{
+	tx_seg = s->seg;
+	process_raw_packet(s->buf, s->len, s->nbuf, rss_batch);
+}
+
+void rss_raw_idle(struct cw_ring *r)
+{
+	aggr_flush(rss_batch);
+	if (rss_batch)
+		batch_flush_all(rss_batch);
+}
+
+void process_raw_to_udp(long q)	// used by mode==0 & mode==1, q is tap queue
+{
+	u_int8_t buf[MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH];
+	u_int8_t nbuf[MAX_PACKET_SIZE + VLAN_TAG_LEN + EVP_MAX_BLOCK_LENGTH];
+	u_int8_t *vbuf = NULL;
+	struct pkt_batch *b = NULL;
+	int fd = tx_seg ? segs[tx_seg].fd : fdtapq[q];
+	int len;
+	int offset = 0;
+
+	udp_shard = q % udp_shards;
+	pin_thread(q);
+	if (rss_workers)	// rss workers do the rest, they have own batch
+		rss_pool = cw_start(rss_workers, rss_raw_init, rss_raw_work, rss_raw_idle);
+	else if (batch_size > 1)
+		b = tx_batch_alloc();
+	if (crypto_workers && (enc_key_len > 0) && (rss_pool == NULL)) {	// rss workers encrypt by themselves
+		cw_pool = cw_start(crypto_workers, NULL, cw_encrypt, NULL);
+		cw_pool->done = cw_raw_done;
+		cw_pool->b = b;
+	}
+	if ((b || cw_pool || aggregate) && (mode != MODEE))
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if ((mode == MODEE) && rx_ring_blocks && (tx_seg == 0))
+		process_rx_ring_to_udp(b);
+	if ((mode != MODEE) && tap_vnet) {
+		vbuf = malloc(VNET_BUF_SIZE);
+		if (vbuf == NULL)
+			err_sys("malloc vnet buf");
+	}
 
-		send_udp_to_remote(pbuf, len, current_remote);
+	while (1) {		// read from eth rawsocket
+		if ((b == NULL) && (cw_pool == NULL) && !aggregate)
+			len = read_raw_packet(fd, vbuf ? vbuf : buf, &offset, 0);
+		else {
+			len = read_raw_packet(fd, vbuf ? vbuf : buf, &offset, MSG_DONTWAIT);
+			if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {	// nothing to read now
+				raw_idle(fd, b);
+				continue;
+			}
+		}
+		if (len <= 0) {
+			stat_add(ST_SHORT_READ, 1);
+			continue;
+		}
+		if (vbuf) {
+			process_vnet_packet(vbuf, len, buf, nbuf, b);
+			continue;
+		}
+		if (debug && offset)
+			printf("offset=%d\n", offset);
+		process_raw_packet(buf + offset, len, nbuf, b);
 	}
 }
 
+/* read frames of segment s, send them with its VNI */
+void process_seg_to_udp(long s)
+{
+	tx_seg = s;
+	process_raw_to_udp(0);
+}
+
 void save_remote_addr(struct sockaddr_storage *rmt, int sock_len, int index)
 {
 	char rip[200];
@@ -998,129 +3825,625 @@ void save_remote_addr(struct sockaddr_storage *rmt, int sock_len, int index)
 	}
 }
 
-void process_udp_to_raw(int index)
+/* send packet to local raw socket or tap */
+void send_raw_packet(u_int8_t * buf, int len)
 {
-	u_int8_t buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-	u_int8_t *pbuf;
-	int len;
+	int ret = -1;
+	int fd = raw_seg ? segs[raw_seg].fd : fdtapq[raw_queue];
+	if (mode == MODEE) {
+		struct sockaddr_ll sll;
+		if (txring.map && (raw_seg == 0)) {
+			stat_send(tx_ring_send(buf, len), 1, len, STAT_RAW);
+			TRACE(TR_RAW_TX, len, 0);
+			return;
+		}
+		memset(&sll, 0, sizeof(sll));
+		sll.sll_family = AF_PACKET;
+		sll.sll_protocol = htons(ETH_P_ALL);
+		sll.sll_ifindex = raw_seg ? segs[raw_seg].ifindex : ifindex;
+		ret = sendto(raw_seg ? fd : fdraw, buf, len, 0, (struct sockaddr *)&sll, sizeof(sll));
+	} else if (((mode == MODEI) || (mode == MODEB)) && tap_vnet) {
+		struct virtio_net_hdr vh;
+		struct iovec iov[2];
+		memset(&vh, 0, sizeof(vh));
+		iov[0].iov_base = &vh;
+		iov[0].iov_len = sizeof(vh);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = len;
+		ret = writev(fd, iov, 2);
+	} else if ((mode == MODEI) || (mode == MODEB))
+		ret = write(fd, buf, len);
+	stat_send(ret, 1, len, STAT_RAW);
+	TRACE(TR_RAW_TX, len, raw_queue);
+}
 
-	while (1) {		// read from remote udp
-		if (nat[index]) {
-			struct sockaddr_storage rmt;
-			socklen_t sock_len = sizeof(struct sockaddr_storage);
-			len = recvfrom(fdudp[index], buf, MAX_PACKET_SIZE, 0, (struct sockaddr *)&rmt, &sock_len);
-			if (debug) {
-				char rip[200];
-				if (rmt.ss_family == AF_INET) {
-					struct sockaddr_in *r = (struct sockaddr_in *)&rmt;
-					Debug("nat mode: len %d recv from %s:%d",
-					      len, inet_ntop(r->sin_family, (void *)&r->sin_addr, rip, 200), ntohs(r->sin_port));
-				} else if (rmt.ss_family == AF_INET6) {
-					struct sockaddr_in6 *r = (struct sockaddr_in6 *)&rmt;
-					Debug("nat mode: len %d recv from [%s]:%d",
-					      len, inet_ntop(r->sin6_family, (void *)&r->sin6_addr, rip, 200), ntohs(r->sin6_port));
-				}
-			}
-			if (len <= 0)
-				continue;
-			if (enc_key_len > 0) {
-				len = do_decrypt((u_int8_t *) buf, len, nbuf);
-				pbuf = nbuf;
-			} else
-				pbuf = buf;
+/* decrypted packet from a peer of hub */
+void hub_udp_plain(u_int8_t * pbuf, int len, u_int8_t * nbuf, struct sockaddr_storage *rmt, socklen_t sock_len)
+{
+	int peer;
 
-			if (len <= 0)
-				continue;
+	if (rmt == NULL)
+		return;
+	peer = hub_peer_find(rmt, sock_len);
+	if ((peer < 0) && (mypassword[0] == 0))	// no password set, accept any peer
+		peer = hub_peer_add(rmt, sock_len);
+	if (memcmp(pbuf, "PASSWORD:", 9) == 0) {	// got password packet
+		int pwlen = strlen(mypassword);
+		if ((peer < 0) && (len > 9 + pwlen) && (memcmp(pbuf + 9, mypassword, pwlen) == 0) && (*(pbuf + 9 + pwlen) == 0))
+			peer = hub_peer_add(rmt, sock_len);
+		if (peer >= 0)
+			hub_peers[peer].last_seen = myticket;
+		return;
+	}
+	if (peer < 0) {
+		stat_add(ST_UNKNOWN_HOST_DROP, 1);
+		TRACE(TR_UNKNOWN_HOST, len, MASTER);
+		Debug("hub packet from unknow host, drop...");
+		return;
+	}
+	if (hub_peers[peer].last_seen != myticket)
+		hub_peers[peer].last_seen = myticket;
 
-			nbuf[len] = 0;
-			if (mypassword[0] == 0) {	// no password set, accept new ip and port
-				Debug("no password, accept new remote ip and port");
-				save_remote_addr(&rmt, sock_len, index);
-				if (memcmp(pbuf, "PASSWORD:", 9) == 0)	// got password packet, skip this packet
-					continue;
-			} else {
-				if (memcmp(pbuf, "PASSWORD:", 9) == 0) {	// got password packet
-					Debug("password packet from remote %s", pbuf);
-					if ((memcmp(pbuf + 9, mypassword, strlen(mypassword)) == 0)
-					    && (*(pbuf + 9 + strlen(mypassword))
-						== 0)) {
-						Debug("password ok");
-						save_remote_addr(&rmt, sock_len, index);
-					} else if (debug)
-						printf("error\n");
-					continue;
-				}
-				if (memcmp((void *)&remote_addr[index], &rmt, sock_len)) {
-					Debug("packet from unknow host, drop...");
-					continue;
-				}
-			}
+	if (memcmp(pbuf, "PING:PING:", 10) == 0) {
+		u_int8_t pong[10];
+		ping_recv[MASTER]++;
+		memcpy(pong, "PONG:PONG:", 10);
+		len = 10;
+		if (enc_key_len > 0) {
+			len = do_encrypt(pong, len, nbuf);
+			pbuf = nbuf;
+		} else
+			pbuf = pong;
+		hub_send(pbuf, len, peer);
+		pong_send[MASTER]++;
+		return;
+	}
+	if (memcmp(pbuf, "PONG:PONG:", 10) == 0)
+		return;
+
+	if (read_only)
+		return;		// read only
+	if (!write_only && fixmss)	// write only, no fix_mss
+		fix_mss(pbuf, len, MASTER);
+	if (debug)
+		printPacket((EtherPacket *) pbuf, len, "from hub peer udpsocket:");
+	if (hub_forward(pbuf, len, peer + 1)) {
+		PCAP_TAP(PCAP_DEC, pbuf, len);
+		send_raw_packet(pbuf, len);
+	}
+}
+
+/* decrypted packet from remote udp */
+void process_udp_plain(int index, u_int8_t * pbuf, int len, u_int8_t * nbuf, struct sockaddr_storage *rmt, socklen_t sock_len)
+{
+	if (len <= 0)
+		return;
+	if (hub_max) {
+		hub_udp_plain(pbuf, len, nbuf, rmt, sock_len);
+		return;
+	}
+
+	if (nat[index]) {
+		if (mypassword[0] == 0) {	// no password set, accept new ip and port
+			Debug("no password, accept new remote ip and port");
+			save_remote_addr(rmt, sock_len, index);
+			if (memcmp(pbuf, "PASSWORD:", 9) == 0)	// got password packet, skip this packet
+				return;
 		} else {
-			len = recv(fdudp[index], buf, MAX_PACKET_SIZE, 0);
-			if (len <= 0)
-				continue;
-			if (enc_key_len > 0) {
-				len = do_decrypt((u_int8_t *) buf, len, nbuf);
-				pbuf = nbuf;
-			} else
-				pbuf = buf;
-			if (len <= 0)
-				continue;
+			if (memcmp(pbuf, "PASSWORD:", 9) == 0) {	// got password packet
+				int pwlen = strlen(mypassword);
+				Debug("password packet from remote %.*s", len, pbuf);
+				if ((len > 9 + pwlen) && (memcmp(pbuf + 9, mypassword, pwlen) == 0)
+				    && (*(pbuf + 9 + pwlen)
+					== 0)) {
+					Debug("password ok");
+					save_remote_addr(rmt, sock_len, index);
+				} else if (debug)
+					printf("error\n");
+				return;
+			}
+			if (memcmp((void *)&remote_addr[index], rmt, sock_len)) {
+				stat_add(ST_UNKNOWN_HOST_DROP, 1);
+				TRACE(TR_UNKNOWN_HOST, len, index);
+				Debug("packet from unknow host, drop...");
+				return;
+			}
 		}
+	}
 
-		if (memcmp(pbuf, "PING:PING:", 10) == 0) {
+	if (memcmp(pbuf, "PING:PING:", 10) == 0) {
+		u_int8_t pong[18];
 #ifdef DEBUGPINGPONG
-			Debug("ping from index %d udp", index);
+		Debug("ping from index %d udp", index);
 #endif
-			ping_recv[index]++;
-			memcpy(buf, "PONG:PONG:", 10);
+		ping_recv[index]++;
+		memcpy(pong, "PONG:PONG:", 10);
+		if (len >= 18) {	// echo timestamp
+			memcpy(pong + 10, pbuf + 10, 8);
+			len = 18;
+		} else
 			len = 10;
-			if (enc_key_len > 0) {
-				len = do_encrypt((u_int8_t *) buf, len, nbuf);
-				pbuf = nbuf;
-			} else
-				pbuf = buf;
-			send_udp_to_remote(pbuf, len, index);
-			pong_send[index]++;
-			continue;
-		}
+		if (enc_key_len > 0) {
+			len = do_encrypt(pong, len, nbuf);
+			pbuf = nbuf;
+		} else
+			pbuf = pong;
+		send_udp_to_remote(pbuf, len, index);
+		pong_send[index]++;
+		return;
+	}
 
-		if (memcmp(pbuf, "PONG:PONG:", 10) == 0) {
+	if (memcmp(pbuf, "PONG:PONG:", 10) == 0) {
 #ifdef DEBUGPINGPONG
-			Debug("pong from index %d udp", index);
+		Debug("pong from index %d udp", index);
 #endif
-			last_pong[index] = myticket;
-			pong_recv[index]++;
+		last_pong[index] = myticket;
+		pong_recv[index]++;
+		if (len >= 18) {
+			u_int64_t ts;
+			memcpy(&ts, pbuf + 10, 8);
+			ts = now_ns() - ts;
+			mp_srtt[index] = mp_srtt[index] ? (mp_srtt[index] * 7 + ts) / 8 : ts;
+		}
+		return;
+	}
+
+	if ((len >= 7) && (memcmp(pbuf, "PMTU:", 5) == 0)) {	// path mtu probe, answer PMTUACK:size
+		u_int8_t ack[10];
+		memcpy(ack, "PMTUACK:", 8);
+		memcpy(ack + 8, pbuf + 5, 2);
+		len = 10;
+		if (enc_key_len > 0) {
+			len = do_encrypt(ack, len, nbuf);
+			pbuf = nbuf;
+		} else
+			pbuf = ack;
+		send_udp_to_remote(pbuf, len, index);
+		return;
+	}
+
+	if ((len >= 10) && (memcmp(pbuf, "PMTUACK:", 8) == 0)) {
+		u_int16_t n;
+		memcpy(&n, pbuf + 8, 2);
+		pmtud_st[index].acked = ntohs(n);
+		return;
+	}
+
+	if (read_only)
+		return;		// read only
+	if (!write_only && fixmss)	// write only, no fix_mss
+		fix_mss(pbuf, len, index);
+
+	if (debug)
+		printPacket((EtherPacket *) pbuf, len, "from remote udpsocket:");
+	PCAP_TAP(PCAP_DEC, pbuf, len);
+	send_raw_packet(pbuf, len);
+}
+
+/* decrypted udp payload, unpack aggregate and decompress by TUN_F_* flags */
+void process_udp_payload(int index, u_int8_t * pbuf, int len, int flags, u_int8_t * nbuf, struct sockaddr_storage *rmt,
+			 socklen_t sock_len)
+{
+	if ((len > 0) && (flags & TUN_F_FRAG) && ((len = frag_reasm(index, &pbuf, len)) == 0))
+		return;
+	if ((len > 0) && (flags & TUN_F_AGGR)) {
+		u_int8_t *p = pbuf, *end = pbuf + len, *f;
+		u_int16_t l;
+		int flen;
+		while (end - p >= 2) {
+			memcpy(&l, p, 2);
+			l = ntohs(l);
+			flen = l & ~AGGR_F_COMP;
+			p += 2;
+			if (flen > end - p) {
+				stat_add(ST_AGGR_ERROR, 1);
+				Debug("bad aggregate, drop the rest");
+				break;
+			}
+			f = p;
+			p += flen;
+			if (l & AGGR_F_COMP)
+				flen = lz4_decompress_frame(&f, flen);
+			process_udp_plain(index, f, flen, nbuf, rmt, sock_len);
+		}
+		return;
+	}
+	if ((len > 0) && (flags & TUN_F_COMP))
+		len = lz4_decompress_frame(&pbuf, len);
+	process_udp_plain(index, pbuf, len, nbuf, rmt, sock_len);
+}
+
+/* -mp packet, receiver puts data packets back in sequence order. a packet after a gap waits in mp_reorder
+ * up to MP_REORDER_USEC, checked when packets arrive and by udp threads when the wait times out.
+ * sequence is 8 bits epoch, random at sender start, and 24 bits counter, a new epoch resets the order.
+ * packets of sequence 0 (ping, pong ...) are not ordered.
+ * mp_lock only guards the queue, one thread at a time (mp_draining) delivers in order without the lock
+ */
+#define MP_REORDER_SLOTS	1024
+#define MP_REORDER_USEC		20000
+#define MP_SEQ_BITS		24
+#define MP_SEQ_MASK		((1 << MP_SEQ_BITS) - 1)
+#define MP_RESTART		(1 << 20)	// sequence this far behind means remote restarted with the same epoch
+
+struct mp_packet {
+	int used;		// 1: queued, 2: being delivered
+	int index, seg, flags, len;
+	u_int32_t seq;
+	int has_rmt;
+	socklen_t sock_len;
+	struct sockaddr_storage rmt;
+	u_int8_t buf[BATCH_BUF_SIZE];
+};
+
+pthread_mutex_t mp_lock = PTHREAD_MUTEX_INITIALIZER;
+struct mp_packet *mp_reorder;
+int mp_queued, mp_started, mp_draining;
+u_int32_t mp_epoch;		// epoch of remote
+u_int32_t mp_next;		// next sequence to deliver
+u_int32_t mp_force;		// give up sequences before it
+u_int64_t mp_wait;		// now_ns() waiting for mp_next since
+
+void mp_init(void)
+{
+	mp_reorder = calloc(MP_REORDER_SLOTS, sizeof(struct mp_packet));
+	if (mp_reorder == NULL)
+		err_sys("malloc mp_reorder");
+	mp_tx_epoch = (getpid() ^ now_ns() / 1000) % 255 + 1;
+}
+
+/* a - b of 24 bits sequences */
+static inline int32_t mp_delta(u_int32_t a, u_int32_t b)
+{
+	return (int32_t) ((a - b) << (32 - MP_SEQ_BITS)) >> (32 - MP_SEQ_BITS);
+}
+
+/* remote restarted, give up queued packets of the old epoch */
+void mp_reset(u_int32_t seq)
+{
+	int i;
+	for (i = 0; i < MP_REORDER_SLOTS; i++)
+		if (mp_reorder[i].used == 1) {
+			mp_reorder[i].used = 0;
+			mp_queued--;
+			stat_add(ST_MP_GAP, 1);
+		}
+	mp_next = mp_force = seq;
+	__atomic_store_n(&mp_wait, now_ns(), __ATOMIC_RELAXED);
+}
+
+/* deliver queued packets from mp_next, skip the missing one if waited too long or before mp_force.
+ * called with mp_lock held and mp_draining set, the lock is released while delivering
+ */
+void mp_drain(u_int8_t * nbuf)
+{
+	struct mp_packet *m;
+
+	while (mp_queued || (mp_delta(mp_force, mp_next) > 0)) {
+		m = &mp_reorder[mp_next % MP_REORDER_SLOTS];
+		if ((m->used == 1) && (m->seq == mp_next)) {
+			m->used = 2;
+			mp_next = (mp_next + 1) & MP_SEQ_MASK;
+			__atomic_store_n(&mp_wait, now_ns(), __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&mp_lock);
+			raw_seg = m->seg;
+			process_udp_payload(m->index, m->buf, m->len, m->flags, nbuf, m->has_rmt ? &m->rmt : NULL, m->sock_len);
+			pthread_mutex_lock(&mp_lock);
+			m->used = 0;
+			mp_queued--;
 			continue;
 		}
+		if ((mp_delta(mp_force, mp_next) <= 0) && (now_ns() - mp_wait < MP_REORDER_USEC * 1000ULL))
+			return;
+		stat_add(ST_MP_GAP, 1);	// lost, or too late
+		mp_next = (mp_next + 1) & MP_SEQ_MASK;
+	}
+}
+
+/* called by udp threads when the oldest queued packet waited MP_REORDER_USEC */
+void mp_tick(u_int8_t * nbuf)
+{
+	pthread_mutex_lock(&mp_lock);
+	if (!mp_draining) {
+		mp_draining = 1;
+		mp_drain(nbuf);
+		mp_draining = 0;
+	}
+	pthread_mutex_unlock(&mp_lock);
+}
+
+/* usec until mp_tick() is due, -1 if nothing is queued */
+long mp_timeout(void)
+{
+	long usec;
+	if ((mp_reorder == NULL) || (__atomic_load_n(&mp_queued, __ATOMIC_RELAXED) == 0))
+		return -1;
+	usec = MP_REORDER_USEC - (long)((now_ns() - __atomic_load_n(&mp_wait, __ATOMIC_RELAXED)) / 1000);
+	return usec > 0 ? usec : 0;
+}
+
+void mp_recv(int index, u_int8_t * pbuf, int len, int flags, u_int32_t seq, u_int8_t * nbuf, struct sockaddr_storage *rmt,
+	     socklen_t sock_len)
+{
+	struct mp_packet *m;
+	u_int32_t epoch = seq >> MP_SEQ_BITS;
+	int32_t d;
+
+	if ((seq == 0) || (mp_reorder == NULL) || (len <= 0) || (len > BATCH_BUF_SIZE)) {
+		process_udp_payload(index, pbuf, len, flags, nbuf, rmt, sock_len);
+		return;
+	}
+	seq &= MP_SEQ_MASK;
+	pthread_mutex_lock(&mp_lock);
+	if (!mp_started || (epoch != mp_epoch)) {	// first packet, or remote restarted
+		mp_started = 1;
+		mp_epoch = epoch;
+		mp_reset(seq);
+	}
+	d = mp_delta(seq, mp_next);
+	if (d < -MP_RESTART) {	// remote restarted and got the same epoch
+		mp_reset(seq);
+		d = 0;
+	}
+	if (d >= MP_REORDER_SLOTS) {	// too far ahead, give up the oldest
+		if (mp_delta(seq - MP_REORDER_SLOTS + 1, mp_force) > 0)
+			mp_force = (seq - MP_REORDER_SLOTS + 1) & MP_SEQ_MASK;
+		if (!mp_draining) {
+			mp_draining = 1;
+			mp_drain(nbuf);
+			mp_draining = 0;
+		}
+		d = mp_delta(seq, mp_next);
+	}
+	if ((d == 0) && !mp_draining) {	// in order, deliver now and then the queued ones
+		mp_next = (mp_next + 1) & MP_SEQ_MASK;
+		__atomic_store_n(&mp_wait, now_ns(), __ATOMIC_RELAXED);
+		mp_draining = 1;
+		pthread_mutex_unlock(&mp_lock);
+		process_udp_payload(index, pbuf, len, flags, nbuf, rmt, sock_len);
+		pthread_mutex_lock(&mp_lock);
+		mp_drain(nbuf);
+		mp_draining = 0;
+		pthread_mutex_unlock(&mp_lock);
+		return;
+	}
+	m = &mp_reorder[seq % MP_REORDER_SLOTS];
+	if ((d < 0) || m->used) {
+		pthread_mutex_unlock(&mp_lock);
+		if (d < 0)	// after its gap was skipped
+			stat_add(ST_MP_LATE, 1);
+		else {
+			stat_add(ST_MP_COLLIDE, 1);
+			if (m->seq == seq)	// duplicate
+				return;
+		}
+		process_udp_payload(index, pbuf, len, flags, nbuf, rmt, sock_len);
+		return;
+	}
+	m->used = 1;
+	m->seq = seq;
+	m->index = index;
+	m->seg = raw_seg;
+	m->flags = flags;
+	m->len = len;
+	memcpy(m->buf, pbuf, len);
+	m->has_rmt = rmt != NULL;
+	if (rmt)
+		memcpy(&m->rmt, rmt, sock_len);
+	m->sock_len = sock_len;
+	mp_queued++;
+	if (d > 0)
+		stat_add(ST_MP_REORDER, 1);
+	if (!mp_draining) {
+		mp_draining = 1;
+		mp_drain(nbuf);
+		mp_draining = 0;
+	}
+	pthread_mutex_unlock(&mp_lock);
+}
+
+void decap_packet(int index, u_int8_t * buf, int len, u_int8_t * nbuf, struct sockaddr_storage *rmt, socklen_t sock_len)
+{
+	u_int8_t *pbuf;
+	int flags = 0;
+	u_int32_t seq = 0;
+
+	if (nat[index] && debug) {
+		char rip[200];
+		if (rmt->ss_family == AF_INET) {
+			struct sockaddr_in *r = (struct sockaddr_in *)rmt;
+			Debug("nat mode: len %d recv from %s:%d", len, inet_ntop(r->sin_family, (void *)&r->sin_addr, rip, 200), ntohs(r->sin_port));
+		} else if (rmt->ss_family == AF_INET6) {
+			struct sockaddr_in6 *r = (struct sockaddr_in6 *)rmt;
+			Debug("nat mode: len %d recv from [%s]:%d",
+			      len, inet_ntop(r->sin6_family, (void *)&r->sin6_addr, rip, 200), ntohs(r->sin6_port));
+		}
+	}
+	if (!nat[index] && rmt && memcmp((void *)&remote_addr[index], rmt, sock_len)) {	// unconnected SO_REUSEPORT socket
+		stat_add(ST_UNKNOWN_HOST_DROP, 1);
+		TRACE(TR_UNKNOWN_HOST, len, index);
+		Debug("packet from unknow host, drop...");
+		return;
+	}
+	if (tun_hdr_len) {
+		int s = tun_hdr_seg(buf, len, &flags);
+		if ((s < 0) || (len < tun_hdr_len)) {
+			stat_add(ST_UNKNOWN_VNI_DROP, 1);
+			Debug("packet of bad tunnel header or unknown vni, drop...");
+			return;
+		}
+		raw_seg = s;
+		if (tun_hdr_len > TUN_HDR_LEN) {
+			memcpy(&seq, buf + TUN_HDR_LEN, 4);
+			seq = ntohl(seq);
+		}
+		buf += tun_hdr_len;
+		len -= tun_hdr_len;
+	}
+	if (enc_key_len > 0) {
+		if (cw_pool) {	// decrypt by crypto worker, then cw_udp_done()
+			struct cw_slot *s;
+			if (len > BATCH_BUF_SIZE)
+				return;
+			s = cw_next(cw_pool);
+			memcpy(s->buf, buf, len);
+			s->len = len;
+			s->index = index;
+			s->seg = raw_seg;
+			s->flags = flags;
+			s->seq = seq;
+			memcpy(s->hdr, buf - tun_hdr_len, tun_hdr_len);
+			s->has_rmt = rmt != NULL;
+			if (rmt)
+				memcpy(&s->rmt, rmt, sock_len);
+			s->sock_len = sock_len;
+			cw_submit(cw_pool);
+			return;
+		}
+		pbuf = enc_inplace ? buf : nbuf;
+		len = do_decrypt(buf, len, pbuf, buf - tun_hdr_len);
+		if (len <= 0) {
+			stat_add(ST_DECRYPT_FAIL, 1);
+			TRACE(TR_DECRYPT_FAIL, 0, index);
+		}
+	} else
+		pbuf = buf;
+	mp_recv(index, pbuf, len, flags, seq, nbuf, rmt, sock_len);
+}
+
+/* process one packet from remote udp, rmt is the remote address in nat mode */
+void process_udp_packet(int index, u_int8_t * buf, int len, u_int8_t * nbuf, struct sockaddr_storage *rmt, socklen_t sock_len)
+{
+	u_int64_t t0;
+
+	if (len <= 0)
+		return;
+	if (rss_pool) {
+		rss_dispatch(rss_pool, flow_hash(buf + tun_hdr_len, len - tun_hdr_len), buf, len, index, rmt, sock_len);
+		return;
+	}
+	stat_add(ST_UDP_RX_PKTS + index, 1);
+	stat_add(ST_UDP_RX_BYTES + index, len);
+	TRACE(TR_UDP_RX, len, index);
+	PCAP_TAP(PCAP_UDP, buf, len);
+	if (metrics_addr == NULL) {
+		decap_packet(index, buf, len, nbuf, rmt, sock_len);
+		return;
+	}
+	t0 = now_ns();
+	decap_packet(index, buf, len, nbuf, rmt, sock_len);
+	stat_hist(HIST_DECAP, now_ns() - t0);
+}
 
-		if (read_only)
-			continue;	// read only
-		if (!write_only && fixmss)	// write only, no fix_mss
-			fix_mss(pbuf, len, index);
+/* decrypted packet from crypto worker */
+void cw_udp_done(struct cw_pool *p, struct cw_slot *s)
+{
+	raw_seg = s->seg;
+	mp_recv(s->index, s->out, s->len, s->flags, s->seq, p->nbuf, s->has_rmt ? &s->rmt : NULL, s->sock_len);
+}
+
+void rss_udp_init(struct cw_ring *r)
+{
+	raw_queue = r->id % tap_queues;
+	udp_shard = r->id % udp_shards;
+	pin_thread(r->id);
+}
+
+void rss_udp_work(struct cw_ring *r, struct cw_slot *s)
+{
+	process_udp_packet(s->index, s->buf, s->len, s->nbuf, s->has_rmt ? &s->rmt : NULL, s->sock_len);
+}
+
+void rss_udp_idle(struct cw_ring *r)
+{
+	if (txring.map)
+		tx_ring_kick();
+}
+
+void process_udp_to_raw(int index)
+{
+	u_int8_t buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
+	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
+	struct pkt_batch *b = NULL;
+	int fd = fdudps[index][udp_shard];
+	int with_addr = nat[index] || (udp_shards > 1);	// need remote address
+	int len, i, n, flags;
+	long usec;
+
+	if (batch_size > 1)
+		b = batch_alloc(batch_size, udp_gso ? GRO_BUF_SIZE : BATCH_BUF_SIZE);
+	if (crypto_workers && (enc_key_len > 0)) {
+		cw_pool = cw_start(crypto_workers, NULL, cw_decrypt, NULL);
+		cw_pool->done = cw_udp_done;
+	} else if (rss_workers && (enc_key_len == 0))	// inner headers are readable only without encryption
+		rss_pool = cw_start(rss_workers, rss_udp_init, rss_udp_work, rss_udp_idle);
 
-		if (debug)
-			printPacket((EtherPacket *) pbuf, len, "from remote udpsocket:");
-		if (mode == MODEE) {
-			struct sockaddr_ll sll;
-			memset(&sll, 0, sizeof(sll));
-			sll.sll_family = AF_PACKET;
-			sll.sll_protocol = htons(ETH_P_ALL);
-			sll.sll_ifindex = ifindex;
-			sendto(fdraw, pbuf, len, 0, (struct sockaddr *)&sll, sizeof(sll));
-		} else if ((mode == MODEI) || (mode == MODEB))
-			write(fdraw, pbuf, len);
+	while (1) {		// read from remote udp
+		flags = 0;
+		if (cw_pool && (cw_pool->seq_out != cw_pool->seq_in))
+			flags = MSG_DONTWAIT;	// do not block with packets in crypto workers
+		else if ((usec = mp_timeout()) >= 0)	// skip reorder gaps in time
+			if ((usec == 0) || (wait_readable(fd, usec) == 0))
+				mp_tick(nbuf);
+		if (b) {
+			for (i = 0; i < b->size; i++) {
+				b->iovs[i].iov_len = udp_gso ? GRO_BUF_SIZE : MAX_PACKET_SIZE;
+				b->msgs[i].msg_hdr.msg_name = with_addr ? &b->addrs[i] : NULL;
+				b->msgs[i].msg_hdr.msg_namelen = with_addr ? sizeof(struct sockaddr_storage) : 0;
+				b->msgs[i].msg_hdr.msg_control = udp_gso ? &b->ctrls[i] : NULL;
+				b->msgs[i].msg_hdr.msg_controllen = udp_gso ? sizeof(b->ctrls[i]) : 0;
+			}
+			n = recvmmsg(fd, b->msgs, b->size, MSG_WAITFORONE | flags, NULL);
+			for (i = 0; i < n; i++) {
+				u_int8_t *p = b->iovs[i].iov_base;
+				int left = b->msgs[i].msg_len, seg = left;
+				struct cmsghdr *cm;
+				if (udp_gso)	// UDP_GRO coalesced packets, split them by gso_size
+					for (cm = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cm))
+						if ((cm->cmsg_level == SOL_UDP) && (cm->cmsg_type == UDP_GRO))
+							seg = *(int *)CMSG_DATA(cm);
+				if (seg <= 0)
+					seg = left;
+				do {
+					len = left > seg ? seg : left;
+					process_udp_packet(index, p, len, nbuf, with_addr ? &b->addrs[i] : NULL, b->msgs[i].msg_hdr.msg_namelen);
+					p += len;
+					left -= len;
+				}
+				while (left > 0);
+			}
+		} else if (with_addr) {
+			struct sockaddr_storage rmt;
+			socklen_t sock_len = sizeof(struct sockaddr_storage);
+			len = recvfrom(fd, buf, MAX_PACKET_SIZE, flags, (struct sockaddr *)&rmt, &sock_len);
+			n = len;
+			process_udp_packet(index, buf, len, nbuf, &rmt, sock_len);
+		} else {
+			n = len = recv(fd, buf, MAX_PACKET_SIZE, flags);
+			process_udp_packet(index, buf, len, nbuf, NULL, 0);
+		}
+		if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+			stat_add(ST_SHORT_READ, 1);
+		if (cw_pool)
+			cw_collect(cw_pool, n < 0);	// nothing more to read, wait for workers
+		if (txring.map)
+			tx_ring_kick();
 	}
 }
 
-void process_udp_to_raw_master(void)
+/* udp->raw worker w reads udp socket w % udp_shards, writes tap queue w % tap_queues */
+void process_udp_to_raw_master(long w)
 {
+	raw_queue = w % tap_queues;
+	udp_shard = w % udp_shards;
+	pin_thread(w);
 	process_udp_to_raw(MASTER);
 }
 
-void process_udp_to_raw_slave(void)
+void process_udp_to_raw_slave(long w)
 {
+	raw_queue = w % tap_queues;
+	udp_shard = w % udp_shards;
+	pin_thread(w);
 	process_udp_to_raw(SLAVE);
 }
 
@@ -1139,6 +4462,10 @@ int open_tun(const char *dev, char **actual)
 	}
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_NO_PI;
+	if (tap_queues > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (tap_vnet)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	if (!strncmp(dev, "tun", 3)) {
 		ifr.ifr_flags |= IFF_TUN;
 	} else if (!strncmp(dev, "tap", 3)) {
@@ -1154,6 +4481,13 @@ int open_tun(const char *dev, char **actual)
 		Debug("Cannot ioctl TUNSETIFF %s", dev);
 		exit(1);
 	}
+	if (tap_vnet) {
+		int hdrsz = sizeof(struct virtio_net_hdr);
+		if (ioctl(fd, TUNSETVNETHDRSZ, &hdrsz) < 0)
+			err_sys("ioctl TUNSETVNETHDRSZ");
+		if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+			err_sys("ioctl TUNSETOFFLOAD");
+	}
 	Debug("TUN/TAP device %s opened", ifr.ifr_name);
 	size = strlen(ifr.ifr_name) + 1;
 	*actual = (char *)malloc(size);
@@ -1170,6 +4504,236 @@ int open_tun(const char *dev, char **actual)
 	return fd;
 }
 
+/* open tap_queues queues of tap device, fdtapq[0] is the first one */
+int open_tun_queues(const char *dev, char **actual)
+{
+	char *name;
+	int q;
+
+	fdtapq[0] = open_tun(dev, actual);
+	for (q = 1; q < tap_queues; q++) {
+		fdtapq[q] = open_tun(*actual, &name);
+		free(name);
+	}
+	return fdtapq[0];
+}
+
+/* sum the counters of all threads, in prometheus text format */
+void metrics_format(FILE * f)
+{
+	u_int64_t c[ST_MAX], hist[HIST_MAX][HIST_BUCKETS], hist_sum[HIST_MAX], cum;
+	struct thread_stats *st;
+	int i, j, k, n = nstats < MAX_STATS_THREADS ? nstats : MAX_STATS_THREADS;
+
+	memset(c, 0, sizeof(c));
+	memset(hist, 0, sizeof(hist));
+	memset(hist_sum, 0, sizeof(hist_sum));
+	for (i = 0; i <= n; i++) {
+		st = i < n ? __atomic_load_n(&all_stats[i], __ATOMIC_ACQUIRE) : &stats_overflow;
+		if (st == NULL)
+			continue;	// registering now
+		for (j = 0; j < ST_MAX; j++)
+			c[j] += __atomic_load_n(&st->c[j], __ATOMIC_RELAXED);
+		for (j = 0; j < HIST_MAX; j++) {
+			for (k = 0; k < HIST_BUCKETS; k++)
+				hist[j][k] += __atomic_load_n(&st->hist[j][k], __ATOMIC_RELAXED);
+			hist_sum[j] += __atomic_load_n(&st->hist_sum[j], __ATOMIC_RELAXED);
+		}
+	}
+	for (j = 0; j < ST_MAX; j++) {
+		if (stat_names[j][1])	// NULL: slave path of the counter before
+			fprintf(f, "# HELP ethudp_%s %s\n# TYPE ethudp_%s counter\n", stat_names[j][0], stat_names[j][1], stat_names[j][0]);
+		if ((j >= ST_UDP_TX_PKTS) && (j <= ST_UDP_RX_BYTES_SLAVE))
+			fprintf(f, "ethudp_%s{link=\"%s\"} %llu\n", stat_names[j][0], (j - ST_UDP_TX_PKTS) % 2 == MASTER ? "master" : "slave",
+				(unsigned long long)c[j]);
+		else
+			fprintf(f, "ethudp_%s %llu\n", stat_names[j][0], (unsigned long long)c[j]);
+	}
+	for (j = 0; j < HIST_MAX; j++) {
+		fprintf(f, "# HELP ethudp_%s %s\n# TYPE ethudp_%s histogram\n", hist_names[j][0], hist_names[j][1], hist_names[j][0]);
+		for (k = 0, cum = 0; k < HIST_BUCKETS - 1; k++) {	// bucket k is [2^k, 2^(k+1) - 1] ns
+			cum += hist[j][k];
+			fprintf(f, "ethudp_%s_bucket{le=\"%g\"} %llu\n", hist_names[j][0], (double)((2ULL << k) - 1) / 1e9,
+				(unsigned long long)cum);
+		}
+		cum += hist[j][k];
+		fprintf(f, "ethudp_%s_bucket{le=\"+Inf\"} %llu\n", hist_names[j][0], (unsigned long long)cum);
+		fprintf(f, "ethudp_%s_sum %g\n", hist_names[j][0], hist_sum[j] / 1e9);
+		fprintf(f, "ethudp_%s_count %llu\n", hist_names[j][0], (unsigned long long)cum);
+	}
+	fprintf(f, "# HELP ethudp_ping_send ping sent in this hour\n# TYPE ethudp_ping_send gauge\n");
+	fprintf(f, "ethudp_ping_send{link=\"master\"} %u\nethudp_ping_send{link=\"slave\"} %u\n", ping_send[MASTER], ping_send[SLAVE]);
+	fprintf(f, "# HELP ethudp_pong_recv pong received in this hour\n# TYPE ethudp_pong_recv gauge\n");
+	fprintf(f, "ethudp_pong_recv{link=\"master\"} %u\nethudp_pong_recv{link=\"slave\"} %u\n", pong_recv[MASTER], pong_recv[SLAVE]);
+	fprintf(f, "# HELP ethudp_link_up 1 if pong received in 5 seconds\n# TYPE ethudp_link_up gauge\n");
+	fprintf(f, "ethudp_link_up{link=\"master\"} %d\n", master_status == STATUS_OK);
+	if (master_slave)
+		fprintf(f, "ethudp_link_up{link=\"slave\"} %d\n", slave_status == STATUS_OK);
+	if (hub_max) {
+		for (i = 0, n = 0; i < hub_npeers; i++)
+			n += hub_peers[i].in_use;
+		fprintf(f, "# HELP ethudp_hub_peers peers of hub\n# TYPE ethudp_hub_peers gauge\nethudp_hub_peers %d\n", n);
+		for (i = 0, n = 0; i < HUB_MAC_BUCKETS * 8; i++)
+			n += hub_macs[i] != 0;
+		fprintf(f, "# HELP ethudp_hub_macs learned MAC addresses\n# TYPE ethudp_hub_macs gauge\nethudp_hub_macs %d\n", n);
+	}
+	if (pmtud || path_mtu) {
+		fprintf(f, "# HELP ethudp_path_mtu path MTU to remote\n# TYPE ethudp_path_mtu gauge\n");
+		fprintf(f, "ethudp_path_mtu{link=\"master\"} %d\n", pmtu[MASTER]);
+		if (master_slave)
+			fprintf(f, "ethudp_path_mtu{link=\"slave\"} %d\n", pmtu[SLAVE]);
+	}
+	if (multipath) {
+		fprintf(f, "# HELP ethudp_rtt_seconds smoothed ping rtt\n# TYPE ethudp_rtt_seconds gauge\n");
+		fprintf(f, "ethudp_rtt_seconds{link=\"master\"} %g\nethudp_rtt_seconds{link=\"slave\"} %g\n", mp_srtt[MASTER] / 1e9,
+			mp_srtt[SLAVE] / 1e9);
+		fprintf(f, "# HELP ethudp_ping_loss_ratio ewma of lost pings\n# TYPE ethudp_ping_loss_ratio gauge\n");
+		fprintf(f, "ethudp_ping_loss_ratio{link=\"master\"} %g\nethudp_ping_loss_ratio{link=\"slave\"} %g\n",
+			mp_loss[MASTER] / 1024.0, mp_loss[SLAVE] / 1024.0);
+		fprintf(f, "# HELP ethudp_multipath_master_share share of flows or packets sent to master\n");
+		fprintf(f, "# TYPE ethudp_multipath_master_share gauge\nethudp_multipath_master_share %g\n", mp_split / 256.0);
+	}
+	fprintf(f, "# HELP ethudp_current_remote 0 master, 1 slave\n# TYPE ethudp_current_remote gauge\nethudp_current_remote %d\n",
+		current_remote);
+}
+
+/* listen on unix socket path or [host:]port, host default 127.0.0.1 */
+int metrics_listen(const char *addr)
+{
+	int fd, n, on = 1;
+
+	if (addr[0] == '/') {
+		struct sockaddr_un un;
+		if (strlen(addr) >= sizeof(un.sun_path))
+			err_quit("metrics socket path too long: %s", addr);
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, addr);
+		unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ((fd < 0) || (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0))
+			err_sys("metrics bind %s error", addr);
+	} else {
+		char host[MAXLEN], *port;
+		struct addrinfo hints, *res;
+		strncpy(host, addr, MAXLEN - 1);
+		host[MAXLEN - 1] = 0;
+		port = strrchr(host, ':');
+		if (port) {
+			*port++ = 0;
+			if (host[0] == '[') {	// [ipv6]:port
+				memmove(host, host + 1, strlen(host));
+				host[strlen(host) - 1] = 0;
+			}
+		} else {
+			port = (char *)addr;
+			strcpy(host, "127.0.0.1");
+		}
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_flags = AI_PASSIVE;
+		hints.ai_socktype = SOCK_STREAM;
+		if ((n = getaddrinfo(host, port, &hints, &res)) != 0)
+			err_quit("metrics address %s error: %s", addr, gai_strerror(n));
+		fd = socket(res->ai_family, SOCK_STREAM, 0);
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if ((fd < 0) || (bind(fd, res->ai_addr, res->ai_addrlen) < 0))
+			err_sys("metrics bind %s error", addr);
+		freeaddrinfo(res);
+	}
+	if (listen(fd, 16) < 0)
+		err_sys("metrics listen error");
+	return fd;
+}
+
+/* serve GET /metrics, any other request gets the metrics too, except GET /capture/start|stop */
+void metrics_thread(long lfd)
+{
+	int fd, n;
+	char req[4096];
+	struct timeval tv = { 1, 0 };
+	char *body;
+	size_t len;
+	FILE *f;
+
+	while (1) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		n = recv(fd, req, sizeof(req) - 1, 0);
+		req[n > 0 ? n : 0] = 0;
+		if (pcap_prefix && ((strncmp(req, "GET /capture/start ", 19) == 0) || (strncmp(req, "GET /capture/stop ", 18) == 0))) {
+			pcap_want = req[15] == 'a';	// st(a)rt or st(o)p
+			dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\ncapture %s\n", pcap_want ? "started" : "stopped");
+			close(fd);
+			continue;
+		}
+		f = open_memstream(&body, &len);
+		if (f) {
+			metrics_format(f);
+			fclose(f);
+			dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n", (unsigned long)len);
+			write(fd, body, len);
+			free(body);
+		}
+		close(fd);
+	}
+}
+
+struct trace_out {
+	struct trace_rec r;
+	u_int32_t tid;
+};
+
+int trace_cmp(const void *a, const void *b)
+{
+	u_int64_t x = ((const struct trace_out *)a)->r.ts, y = ((const struct trace_out *)b)->r.ts;
+	return x < y ? -1 : x > y;
+}
+
+/* EthUDP -T file, print trace records of all threads by time */
+void trace_decode(const char *file)
+{
+	struct trace_file *tf;
+	struct trace_out *out;
+	u_int64_t h, i, n = 0;
+	int fd, k;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		err_sys("open %s", file);
+	tf = mmap(NULL, sizeof(struct trace_file), PROT_READ, MAP_SHARED, fd, 0);
+	if (tf == MAP_FAILED)
+		err_sys("mmap %s", file);
+	if ((tf->magic != TRACE_MAGIC) || (tf->nrings != TRACE_RINGS) || (tf->ring_size != TRACE_RING_SIZE))
+		err_quit("%s is not a trace file of this version", file);
+	out = malloc(sizeof(struct trace_out) * TRACE_RINGS * TRACE_RING_SIZE);
+	if (out == NULL)
+		err_sys("malloc trace");
+	for (k = 0; k < TRACE_RINGS; k++) {
+		h = __atomic_load_n(&tf->ring[k].head, __ATOMIC_ACQUIRE);
+		for (i = h > TRACE_RING_SIZE ? h - TRACE_RING_SIZE : 0; i < h; i++) {
+			out[n].r = tf->ring[k].rec[i % TRACE_RING_SIZE];
+			out[n].tid = tf->ring[k].tid;
+			if (out[n].r.ev < TR_MAX)
+				n++;
+		}
+	}
+	qsort(out, n, sizeof(struct trace_out), trace_cmp);
+	for (i = 0; i < n; i++) {
+		const char **name = trace_names[out[i].r.ev];
+		printf("%llu.%06llu %6u %-14s", (unsigned long long)out[i].r.ts / 1000000000ULL,
+		       (unsigned long long)(out[i].r.ts % 1000000000ULL) / 1000, out[i].tid, name[0]);
+		if (name[1][0])
+			printf(" %s=%u", name[1], out[i].r.a);
+		if (name[2][0])
+			printf(" %s=%u", name[2], out[i].r.b);
+		printf("\n");
+	}
+	exit(0);
+}
+
 void usage(void)
 {
 	printf("Usage:\n");
@@ -1179,63 +4743,399 @@ void usage(void)
 	printf("            [ localip localport remoteip remoteport ]\n");
 	printf("./EthUDP -b [ options ] localip localport remoteip remoteport bridge \\\n");
 	printf("            [ localip localport remoteip remoteport ]\n");
+	printf("./EthUDP -T file       print records of trace file\n");
 	printf("     options:\n");
 	printf("         -p password\n");
-	printf("         -enc [ xor | aes-128 | aes-192 | aes-256 ]\n");
+	printf("         -enc [ xor | aes-128 | aes-192 | aes-256 | aes-128-gcm | aes-256-gcm | chacha20-poly1305 ]\n");
 	printf("         -k key_string\n");
 	printf("         -d    enable debug\n");
 	printf("         -f    enable fix mss\n");
 	printf("         -r    read only of ethernet interface\n");
 	printf("         -w    write only of ethernet interface\n");
 	printf("         -B    benchmark\n");
+	printf("         -Bjson file   -B write results to json file\n");
+	printf("         -Bthreads n   -B run with 1, 2, 4 ... n threads\n");
+	printf("         -batch n      recvmmsg/sendmmsg n packets per syscall(1-%d), default 1\n", MAX_BATCH);
+	printf("         -flush usec   max usec a packet waits in sendmmsg batch, default 0\n");
+	printf("         -rxring n     mode e read packets from n MB TPACKET_V3 mmap ring\n");
+	printf("         -txring n     mode e send packets via n MB TPACKET_V3 mmap ring\n");
+	printf("         -mq n         mode i/b open n queues of tap, one thread pair per queue(1-%d)\n", MAX_QUEUES);
+	printf("         -cpu n,n,...  pin threads of queue n to cpu list\n");
+	printf("         -reuseport n  open n SO_REUSEPORT udp sockets per connection, one thread per socket(1-%d)\n", MAX_QUEUES);
+	printf("         -steercpu     -reuseport select socket by receiving cpu\n");
+	printf("         -vnet         mode i/b read TSO packets from tap and segment them\n");
+	printf("         -gso          send with UDP_SEGMENT, recv with UDP_GRO(need -batch)\n");
+	printf("         -cw n         n crypto worker threads for each reader thread(1-%d)\n", MAX_QUEUES);
+	printf("         -rss n        spread packets of each reader thread to n threads by inner flow hash(1-%d)\n", MAX_QUEUES);
+	printf("         -metrics addr serve prometheus metrics on unix socket /path or [host:]port, host default 127.0.0.1\n");
+	printf("                       GET /capture/start or /capture/stop to start or stop -pcap capture\n");
+	printf("         -hub n        hub of up to n peers, remote must be 0.0.0.0 0, frames are forwarded by learned MAC\n");
+#ifdef ENABLE_LZ4
+	printf("         -z lz4        compress frames by lz4, both sides need it, adds tunnel header\n");
+#endif
+	printf("         -aggr usec    pack small frames into one udp packet, sent when full or usec after first frame,\n");
+	printf("                       both sides need it, adds tunnel header\n");
+	printf("         -aggrsize n   max bytes of packed frames(128-%d), default 1400\n", MAX_PACKET_SIZE);
+	printf("         -mtu n        path MTU(576-65535), longer frames are sent in fragments, both sides need it\n");
+	printf("         -pmtud        probe path MTU(not above -mtu n) for fragments and -f, both sides need it\n");
+	printf("         -mp flow|packet  send over master and slave together by flow hash, or by packet reordered by\n");
+	printf("                       remote(both sides need -mp packet), weighted by rtt and loss\n");
+	printf("         -vni n        add tunnel header with VNI n(0-16777215) of the interface of command line\n");
+	printf("         -seg vni:ifname[:bridge] one more segment, mode e: raw socket of ifname, mode i/b: tap ifname(tapN),\n");
+	printf("                       added to bridge if given, frames are sent with vni, received by vni\n");
+	printf("         -pcap prefix  capture packets to prefix.N.pcapng, kill -USR1 to start or stop\n");
+	printf("         -pcappoints raw,enc,udp,dec  tap points, default all: raw read, encrypted, udp read, decrypted\n");
+	printf("         -pcapsnap n   save first n bytes of each packet\n");
+	printf("         -pcapsize MB  switch to next file after MB, default 100\n");
+	printf("         -pcapfiles n  keep n files, default 10\n");
+#ifdef ENABLE_TRACE
+	printf("         -trace file   write binary trace records to file, e.g. /dev/shm/EthUDP.trace\n");
+#endif
 	printf("         -nopromisc    do not set ethernet interface to promisc mode(mode e)\n");
 	printf("         -noloopcheck  do not check loopback(-r default do check)\n");
 	exit(0);
 }
 
-#define BENCHCNT 300000
-#define PKT_LEN 1500
+/* check csum_partial and the fix_mss incremental update against the
+   scalar code, run by -B before benchmarking */
+void csum_selfcheck(void)
+{
+	u_int8_t buf[MAX_PACKET_SIZE + 4];
+	int i, off, len;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = random();
+	for (off = 0; off < 4; off++)
+		for (len = 0; len <= MAX_PACKET_SIZE; len++)
+			if (csum_fold(csum_partial(buf + off, len, 0x1234)) != csum_fold(csum_partial_ref(buf + off, len, 0x1234)))
+				err_quit("csum_partial self check error, off %d len %d", off, len);
+
+	for (off = 0; off < 2; off++) {	// MSS option at even and odd offset
+		u_int8_t *pkt = buf;
+		struct iphdr *ip = (struct iphdr *)(pkt + 14);
+		struct tcphdr *tcph = (struct tcphdr *)(pkt + 34);
+		u_int8_t *opt = (u_int8_t *) tcph + 20;
+		u_int16_t check;
+		int tcplen = 40 + 33;	// odd payload length
+
+		memset(pkt, 0, 14 + 20 + 20);
+		pkt[12] = 0x08;
+		ip->version = 4;
+		ip->ihl = 5;
+		ip->protocol = IPPROTO_TCP;
+		ip->tot_len = htons(20 + tcplen);
+		tcph->doff = 10;
+		tcph->syn = 1;
+		memset(opt, TCPOPT_NOP, 20);
+		opt[off] = 2;
+		opt[off + 1] = 4;
+		opt[off + 2] = 1460 >> 8;
+		opt[off + 3] = 1460 & 0xff;
+		tcph->check = 0;
+		tcph->check = tcp_sum_calc(tcplen, (u_int16_t *) & ip->saddr, (u_int16_t *) & ip->daddr, (u_int16_t *) tcph);
+		transfamily[0] = PF_INET;
+		fix_mss(pkt, 14 + 20 + tcplen, 0);
+		if (opt[off + 2] == 1460 >> 8 && opt[off + 3] == (1460 & 0xff))
+			err_quit("fix_mss self check error, mss not changed");
+		check = tcph->check;
+		tcph->check = 0;
+		if (check != tcp_sum_calc(tcplen, (u_int16_t *) & ip->saddr, (u_int16_t *) & ip->daddr, (u_int16_t *) tcph))
+			err_quit("fix_mss self check error, mss offset %d", off);
+	}
+	transfamily[0] = 0;
+	fprintf(stderr, "checksum self check ok, csum_partial %s\n", csum_partial_name);
+}
 
-void do_benchmark(void)
+/* -B benchmark suite
+ * every stage runs over packet size mixes and thread counts, each thread times chunks of
+ * BENCH_CHUNK packets with CLOCK_MONOTONIC after warmup, p50/p99 are ns/packet of the chunks.
+ * stages do no syscall, encap/decap is the per packet work between read and send.
+ */
+#define BENCH_PKTS	200000	// per thread per run
+#define BENCH_WARMUP	(BENCH_PKTS / 10)
+#define BENCH_CHUNK	64
+#define BENCH_MIX_MAX	12
+
+enum { FRAME_UDP, FRAME_SYN, FRAME_ACK };
+
+struct bench_stage {
+	const char *name;
+	int frame;		// FRAME_*
+	int need_cipher;
+};
+
+struct bench_stage bench_stages[] = {
+	{"encrypt", FRAME_UDP, 1},
+	{"decrypt", FRAME_UDP, 1},
+	{"xor_ref", FRAME_UDP, 1},
+	{"fix_mss_syn", FRAME_SYN, 0},
+	{"fix_mss_ack", FRAME_ACK, 0},
+	{"loopback_check", FRAME_UDP, 0},
+	{"vlan_insert", FRAME_UDP, 0},
+	{"csum_partial", FRAME_UDP, 0},
+	{"csum_ref", FRAME_UDP, 0},
+	{"encap", FRAME_ACK, 0},
+	{"decap", FRAME_ACK, 0},
+};
+
+struct bench_mix {
+	const char *name;
+	int n;
+	int len[BENCH_MIX_MAX];
+};
+
+struct bench_mix bench_mixes[] = {
+	{"64", 1, {64}},
+	{"576", 1, {576}},
+	{"1500", 1, {1500}},
+	{"imix", 12, {64, 64, 64, 64, 64, 64, 64, 576, 576, 576, 576, 1500}},	// simple IMIX 7:4:1
+};
+
+struct bench_thread {
+	int stage;
+	struct bench_mix *mix;
+	pthread_barrier_t *barrier;
+	u_int8_t frame[BENCH_MIX_MAX][BATCH_BUF_SIZE];
+	u_int8_t cipher[BENCH_MIX_MAX][BATCH_BUF_SIZE];
+	int clen[BENCH_MIX_MAX];
+	u_int8_t work[BATCH_BUF_SIZE + VLAN_TAG_LEN];
+	u_int8_t out[BATCH_BUF_SIZE];
+	float samples[BENCH_PKTS / BENCH_CHUNK];
+	int nsamples;
+	u_int64_t bytes;
+};
+
+/* ether + ipv4 + udp or tcp frame of len bytes */
+void bench_frame(u_int8_t * buf, int len, int kind)
 {
-	u_int8_t buf[MAX_PACKET_SIZE];
-	u_int8_t nbuf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-	unsigned long int pkt_cnt;
-	int len;
-	struct timeval start_tm, end_tm;
-	gettimeofday(&start_tm, NULL);
-	fprintf(stderr, "benchmarking for %d packets, %d size...\n", BENCHCNT, PKT_LEN);
-	fprintf(stderr, "enc_algorithm = %s\n",
-		enc_algorithm == XOR ? "xor" : enc_algorithm == AES_128 ? "aes-128" : enc_algorithm == AES_192 ? "aes-192" : enc_algorithm ==
-		AES_256 ? "aes-256" : "none");
-	fprintf(stderr, "      enc_key = %s\n", enc_key);
-	fprintf(stderr, "      key_len = %d\n", enc_key_len);
-	pkt_cnt = BENCHCNT;
-	while (1) {
-		len = PKT_LEN;
-		len = do_encrypt(buf, len, nbuf);
-		pkt_cnt--;
-		if (pkt_cnt == 0)
+	struct iphdr *ip = (struct iphdr *)(buf + 14);
+	u_int8_t *l4 = buf + 34;
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = random();
+	buf[12] = 0x08;
+	buf[13] = 0x00;
+	memset(ip, 0, 20);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->tot_len = htons(len - 14);
+	ip->saddr = htonl(0x0a000001);
+	ip->daddr = htonl(0x0a000002);
+	if (kind == FRAME_UDP) {
+		struct udphdr *uh = (struct udphdr *)l4;
+		ip->protocol = IPPROTO_UDP;
+		uh->source = htons(1000);
+		uh->dest = htons(2000);
+		uh->len = htons(len - 34);
+		uh->check = 0;
+	} else {
+		struct tcphdr *th = (struct tcphdr *)l4;
+		ip->protocol = IPPROTO_TCP;
+		memset(th, 0, 24);
+		th->source = htons(1000);
+		th->dest = htons(2000);
+		th->doff = 6;
+		if (kind == FRAME_SYN)
+			th->syn = 1;
+		else
+			th->ack = 1;
+		l4[20] = 2;	// MSS 1460
+		l4[21] = 4;
+		l4[22] = 1460 >> 8;
+		l4[23] = 1460 & 0xff;
+		th->check = tcp_sum_calc(len - 34, (u_int16_t *) & ip->saddr, (u_int16_t *) & ip->daddr, (u_int16_t *) th);
+	}
+	ip->check = csum_fold(csum_partial((u_int8_t *) ip, 20, 0));
+}
+
+int bench_one(struct bench_thread *t, int k)
+{
+	int m = k % t->mix->n, len = t->mix->len[m];
+	u_int8_t *frame = t->frame[m];
+
+	switch (t->stage) {
+	case 0:
+		do_encrypt(frame, len, t->out);
+		break;
+	case 1:
+		do_decrypt(t->cipher[m], t->clen[m], t->out, NULL);
+		break;
+	case 2:
+		xor_encrypt_ref(frame, len, t->out);
+		break;
+	case 3:
+		memcpy(t->work, frame, 58);	// fix_mss changes the MSS only once
+		fix_mss(t->work, len, MASTER);
+		break;
+	case 4:
+		fix_mss(frame, len, MASTER);
+		break;
+	case 5:
+		do_loopback_check(frame, len);
+		break;
+	case 6:
+		vlan_tag_insert(t->work + VLAN_TAG_LEN, 0x0081, 100);
+		break;
+	case 7:
+		csum_partial(frame, len, 0);
+		break;
+	case 8:
+		csum_partial_ref(frame, len, 0);
+		break;
+	case 9:		// process_raw_packet() without send
+		if (do_loopback_check(frame, len))
 			break;
+		fix_mss(frame, len, MASTER);
+		if (enc_key_len > 0)
+			do_encrypt(frame, len, t->out);
+		else
+			memcpy(t->out, frame, len);
+		break;
+	case 10:		// process_udp_packet() without write
+		if (enc_key_len > 0)
+			len = do_decrypt(t->cipher[m], t->clen[m], t->out, NULL);
+		else
+			memcpy(t->out, frame, len);
+		if ((len > 10) && (memcmp(t->out, "PING:PING:", 10) != 0) && (memcmp(t->out, "PONG:PONG:", 10) != 0))
+			fix_mss(t->out, len, MASTER);
+		break;
+	}
+	return len;
+}
+
+void bench_thread_run(struct bench_thread *t)
+{
+	struct timespec st, et;
+	int i, k = 0;
+
+	for (i = 0; i < BENCH_WARMUP; i++)
+		bench_one(t, k++);
+	pthread_barrier_wait(t->barrier);
+	t->nsamples = 0;
+	t->bytes = 0;
+	while (t->nsamples < BENCH_PKTS / BENCH_CHUNK) {
+		clock_gettime(CLOCK_MONOTONIC, &st);
+		for (i = 0; i < BENCH_CHUNK; i++)
+			t->bytes += bench_one(t, k++);
+		clock_gettime(CLOCK_MONOTONIC, &et);
+		t->samples[t->nsamples++] = ((et.tv_sec - st.tv_sec) * 1000000000.0 + (et.tv_nsec - st.tv_nsec)) / BENCH_CHUNK;
+	}
+	pthread_barrier_wait(t->barrier);
+}
+
+int float_cmp(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+	return x < y ? -1 : x > y;
+}
+
+void bench_run(int stage, struct bench_mix *mix, int nthreads, FILE * json, int *first)
+{
+	struct bench_thread *t;
+	pthread_t tid[MAX_QUEUES];
+	pthread_barrier_t barrier;
+	struct timespec st, et;
+	float *all, wall, ns, gbps, mpps;
+	u_int64_t bytes = 0;
+	int i, j, n = 0;
+
+	t = calloc(nthreads, sizeof(struct bench_thread));
+	all = malloc(sizeof(float) * nthreads * (BENCH_PKTS / BENCH_CHUNK));
+	if ((t == NULL) || (all == NULL))
+		err_sys("malloc bench");
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		t[i].stage = stage;
+		t[i].mix = mix;
+		t[i].barrier = &barrier;
+		for (j = 0; j < mix->n; j++) {
+			bench_frame(t[i].frame[j], mix->len[j], bench_stages[stage].frame);
+			if (enc_key_len > 0)
+				t[i].clen[j] = do_encrypt(t[i].frame[j], mix->len[j], t[i].cipher[j]);
+		}
+		memcpy(t[i].work + VLAN_TAG_LEN, t[i].frame[0], 12);
+		if (pthread_create(&tid[i], NULL, (void *)bench_thread_run, (void *)&t[i]) != 0)
+			err_sys("pthread_create bench");
+	}
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &et);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tid[i], NULL);
+		memcpy(all + n, t[i].samples, sizeof(float) * t[i].nsamples);
+		n += t[i].nsamples;
+		bytes += t[i].bytes;
+	}
+	pthread_barrier_destroy(&barrier);
+	qsort(all, n, sizeof(float), float_cmp);
+
+	wall = (et.tv_sec - st.tv_sec) * 1000000000.0 + (et.tv_nsec - st.tv_nsec);
+	ns = wall / BENCH_PKTS;	// per packet of one thread
+	mpps = (float)nthreads *BENCH_PKTS * 1000.0 / wall;
+	gbps = 8.0 * bytes / wall;
+	fprintf(stderr, "%-15s %-5s %2d threads %9.1f ns/pkt %8.3f Mpps %8.2f Gbps  p50 %9.1f  p99 %9.1f\n",
+		bench_stages[stage].name, mix->name, nthreads, ns, mpps, gbps, all[n / 2], all[n * 99 / 100]);
+	if (json) {
+		fprintf(json, "%s\n    {\"stage\": \"%s\", \"mix\": \"%s\", \"threads\": %d, \"ns_per_pkt\": %.1f, \"mpps\": %.4f, "
+			"\"gbps\": %.3f, \"p50_ns\": %.1f, \"p99_ns\": %.1f}", *first ? "" : ",", bench_stages[stage].name, mix->name,
+			nthreads, ns, mpps, gbps, all[n / 2], all[n * 99 / 100]);
+		*first = 0;
+	}
+	free(all);
+	free(t);
+}
+
+void do_benchmark(void)
+{
+	FILE *json = NULL;
+	int s, m, n, first = 1;
+
+	csum_selfcheck();
+	transfamily[MASTER] = PF_INET;	// fix_mss clamps to udp over ipv4
+	fprintf(stderr, "benchmarking %d packets per thread, enc_algorithm = %s, key_len = %d, xor %s\n",
+		BENCH_PKTS, enc_algorithm_name(), enc_key_len, xor_block_name);
+	if (bench_json) {
+		json = fopen(bench_json, "w");
+		if (json == NULL)
+			err_sys("open %s", bench_json);
+		fprintf(json, "{\n  \"enc_algorithm\": \"%s\",\n  \"results\": [", enc_algorithm_name());
+	}
+	for (s = 0; s < sizeof(bench_stages) / sizeof(bench_stages[0]); s++) {
+		if (bench_stages[s].need_cipher && (enc_key_len == 0))
+			continue;
+		if ((s == 2) && (enc_algorithm != XOR))
+			continue;	// xor_ref is the reference of xor encrypt
+		for (m = 0; m < sizeof(bench_mixes) / sizeof(bench_mixes[0]); m++)
+			for (n = 1;; n = n * 2 > bench_threads ? bench_threads : n * 2) {
+				bench_run(s, &bench_mixes[m], n, json, &first);
+				if (n == bench_threads)
+					break;
+			}
+	}
+	if (json) {
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
 	}
-	gettimeofday(&end_tm, NULL);
-	float tspan = ((end_tm.tv_sec - start_tm.tv_sec) * 1000000L + end_tm.tv_usec) - start_tm.tv_usec;
-	tspan = tspan / 1000000L;
-	fprintf(stderr, "%0.3f seconds\n", tspan);
-	fprintf(stderr, "PPS: %.0f PKT/S, %.0f Byte/S\n", (float)BENCHCNT / tspan, 1.0 * (PKT_LEN) * (float)BENCHCNT / tspan);
-	fprintf(stderr, "UDP BPS: %.0f BPS\n", 8.0 * (PKT_LEN) * (float)BENCHCNT / tspan);
 	exit(0);
 }
 
 int main(int argc, char *argv[])
 {
 	pthread_t tid;
+	long q;
 	int i = 1;
 	int got_one = 0;
+	csum_setup();
 	do {
 		got_one = 1;
-		if (argc - i <= 0)
+		if (argc - i <= 0) {
+			if (benchmark)
+				break;	// -B needs no more args
 			usage();
+		}
 		if (strcmp(argv[i], "-e") == 0)
 			mode = MODEE;
 		else if (strcmp(argv[i], "-i") == 0)
@@ -1256,13 +5156,234 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[i], "-noloopcheck") == 0)
 			loopback_check = 0;
 		else if (strcmp(argv[i], "-B") == 0)
-			do_benchmark();
+			benchmark = 1;
+		else if (strcmp(argv[i], "-Bjson") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			bench_json = argv[i];
+		} else if (strcmp(argv[i], "-Bthreads") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			bench_threads = atoi(argv[i]);
+			if ((bench_threads < 1) || (bench_threads > MAX_QUEUES))
+				usage();
+		}
 		else if (strcmp(argv[i], "-p") == 0) {
 			i++;
 			if (argc - i <= 0)
 				usage();
 			strncpy(mypassword, argv[i], MAXLEN - 1);
-		} else if (strcmp(argv[i], "-enc") == 0) {
+		} else if (strcmp(argv[i], "-batch") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			batch_size = atoi(argv[i]);
+			if ((batch_size < 1) || (batch_size > MAX_BATCH))
+				usage();
+		} else if (strcmp(argv[i], "-flush") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			flush_usec = atoi(argv[i]);
+			if (flush_usec < 0)
+				usage();
+		} else if (strcmp(argv[i], "-rxring") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			rx_ring_blocks = atoi(argv[i]);
+			if (rx_ring_blocks < 1)
+				usage();
+		} else if (strcmp(argv[i], "-txring") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			tx_ring_blocks = atoi(argv[i]);
+			if (tx_ring_blocks < 1)
+				usage();
+		} else if (strcmp(argv[i], "-mq") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			tap_queues = atoi(argv[i]);
+			if ((tap_queues < 1) || (tap_queues > MAX_QUEUES))
+				usage();
+		} else if (strcmp(argv[i], "-cpu") == 0) {
+			char *p;
+			i++;
+			if (argc - i <= 0)
+				usage();
+			cpu_count = 0;
+			for (p = strtok(argv[i], ","); p && (cpu_count < MAX_QUEUES); p = strtok(NULL, ","))
+				cpu_list[cpu_count++] = atoi(p);
+		} else if (strcmp(argv[i], "-reuseport") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			udp_shards = atoi(argv[i]);
+			if ((udp_shards < 1) || (udp_shards > MAX_QUEUES))
+				usage();
+		} else if (strcmp(argv[i], "-steercpu") == 0)
+			steer_cpu = 1;
+		else if (strcmp(argv[i], "-gso") == 0)
+			udp_gso = 1;
+		else if (strcmp(argv[i], "-vnet") == 0)
+			tap_vnet = 1;
+		else if (strcmp(argv[i], "-cw") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			crypto_workers = atoi(argv[i]);
+			if ((crypto_workers < 0) || (crypto_workers > MAX_QUEUES))
+				usage();
+#ifdef ENABLE_TRACE
+		} else if (strcmp(argv[i], "-trace") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			trace_file_name = argv[i];
+#endif
+		} else if (strcmp(argv[i], "-T") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			trace_decode(argv[i]);
+		} else if (strcmp(argv[i], "-metrics") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			metrics_addr = argv[i];
+		} else if (strcmp(argv[i], "-hub") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			hub_max = atoi(argv[i]);
+			if ((hub_max < 1) || (hub_max > HUB_MAX_PEERS))
+				usage();
+		} else if (strcmp(argv[i], "-z") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			if (strcmp(argv[i], "lz4") != 0)
+				usage();
+#ifndef ENABLE_LZ4
+			err_quit("-z lz4: built without lz4, install lz4 headers (liblz4-dev) and make again");
+#endif
+			compress_lz4 = 1;
+			tun_hdr_len = TUN_HDR_LEN;
+		} else if (strcmp(argv[i], "-aggr") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			aggr_usec = atoi(argv[i]);
+			if (aggr_usec < 0)
+				usage();
+			aggregate = 1;
+			tun_hdr_len = TUN_HDR_LEN;
+		} else if (strcmp(argv[i], "-aggrsize") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			aggr_size = atoi(argv[i]);
+			if ((aggr_size < 128) || (aggr_size > MAX_PACKET_SIZE))
+				usage();
+		} else if (strcmp(argv[i], "-mtu") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			path_mtu = atoi(argv[i]);
+			if ((path_mtu < 576) || (path_mtu > 65535))
+				usage();
+			tun_hdr_len = TUN_HDR_LEN;
+		} else if (strcmp(argv[i], "-pmtud") == 0) {
+			pmtud = 1;
+			tun_hdr_len = TUN_HDR_LEN;
+		} else if (strcmp(argv[i], "-mp") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			if (strcmp(argv[i], "flow") == 0)
+				multipath = MP_FLOW;
+			else if (strcmp(argv[i], "packet") == 0)
+				multipath = MP_PACKET;
+			else
+				usage();
+		} else if (strcmp(argv[i], "-vni") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			segs[0].vni = atoi(argv[i]);
+			if (segs[0].vni > 0xffffff)
+				usage();
+			tun_hdr_len = TUN_HDR_LEN;
+		} else if (strcmp(argv[i], "-seg") == 0) {
+			char *p;
+			i++;
+			if ((argc - i <= 0) || (nsegs == MAX_SEGS))
+				usage();
+			segs[nsegs].vni = strtoul(argv[i], &p, 10);
+			if ((*p != ':') || (p[1] == 0) || (segs[nsegs].vni > 0xffffff))
+				usage();
+			segs[nsegs].ifname = p + 1;
+			p = strchr(p + 1, ':');
+			if (p) {	// vni:tap:bridge
+				*p = 0;
+				segs[nsegs].bridge = p + 1;
+			}
+			nsegs++;
+			tun_hdr_len = TUN_HDR_LEN;
+		} else if (strcmp(argv[i], "-pcap") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			pcap_prefix = argv[i];
+		} else if (strcmp(argv[i], "-pcappoints") == 0) {
+			char *p;
+			int k;
+			i++;
+			if (argc - i <= 0)
+				usage();
+			pcap_points = 0;
+			for (p = strtok(argv[i], ","); p; p = strtok(NULL, ",")) {
+				for (k = 0; k < PCAP_MAX; k++)
+					if (strcmp(p, pcap_point_names[k]) == 0)
+						break;
+				if (k == PCAP_MAX)
+					usage();
+				pcap_points |= 1 << k;
+			}
+		} else if (strcmp(argv[i], "-pcapsnap") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			pcap_snaplen = atoi(argv[i]);
+			if (pcap_snaplen < 1)
+				usage();
+		} else if (strcmp(argv[i], "-pcapsize") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			pcap_file_size = atol(argv[i]) * 1024 * 1024;
+			if (pcap_file_size < 1)
+				usage();
+		} else if (strcmp(argv[i], "-pcapfiles") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			pcap_files = atoi(argv[i]);
+			if (pcap_files < 1)
+				usage();
+		} else if (strcmp(argv[i], "-rss") == 0) {
+			i++;
+			if (argc - i <= 0)
+				usage();
+			rss_workers = atoi(argv[i]);
+			if ((rss_workers < 0) || (rss_workers > MAX_QUEUES))
+				usage();
+		}
+		else if (strcmp(argv[i], "-enc") == 0) {
 			i++;
 			if (argc - i <= 0)
 				usage();
@@ -1274,11 +5395,17 @@ int main(int argc, char *argv[])
 				enc_algorithm = AES_192;
 			else if (strcmp(argv[i], "aes-256") == 0)
 				enc_algorithm = AES_256;
+			else if (strcmp(argv[i], "aes-128-gcm") == 0)
+				enc_algorithm = AES_128_GCM;
+			else if (strcmp(argv[i], "aes-256-gcm") == 0)
+				enc_algorithm = AES_256_GCM;
+			else if (strcmp(argv[i], "chacha20-poly1305") == 0)
+				enc_algorithm = CHACHA20_POLY1305;
 		} else if (strcmp(argv[i], "-k") == 0) {
 			i++;
 			if (argc - i <= 0)
 				usage();
-			memset(enc_key, MAXLEN, 0);
+			memset(enc_key, 0, MAXLEN);
 			strncpy((char *)enc_key, argv[i], MAXLEN - 1);
 			enc_key_len = strlen((char *)enc_key);
 		} else
@@ -1287,6 +5414,14 @@ int main(int argc, char *argv[])
 			i++;
 	}
 	while (got_one);
+	if (multipath == MP_PACKET) {
+		tun_hdr_len = TUN_HDR_MAX;
+		tx_data_flags = TUN_F_SEQ;
+		mp_init();
+	}
+	setup_cipher();
+	if (benchmark)
+		do_benchmark();
 	if ((mode == MODEE) || (mode == MODEB)) {
 		if (argc - i == 9)
 			master_slave = 1;
@@ -1301,13 +5436,19 @@ int main(int argc, char *argv[])
 	}
 	if (mode == -1)
 		usage();
+	if (tap_vnet && (mode == MODEE))
+		err_quit("-vnet works with tap of mode i or b, not mode e");
+	if (multipath && !master_slave)
+		err_quit("-mp needs master and slave");
+	if (mode == MODEE)
+		tap_queues = 1;	// multi-queue is for tap only
+	if (udp_gso && (batch_size == 1))
+		batch_size = 64;	// gso/gro works on batch
 	if (debug) {
 		printf("         debug = 1\n");
 		printf("          mode = %d (0 raw eth bridge, 1 interface, 2 bridge)\n", mode);
 		printf("      password = %s\n", mypassword);
-		printf(" enc_algorithm = %s\n",
-		       enc_algorithm == XOR ? "xor" : enc_algorithm == AES_128 ? "aes-128" : enc_algorithm == AES_192 ? "aes-192" : enc_algorithm ==
-		       AES_256 ? "aes-256" : "none");
+		printf(" enc_algorithm = %s\n", enc_algorithm_name());
 		printf("       enc_key = %s\n", enc_key);
 		printf("       key_len = %d\n", enc_key_len);
 		printf("  master_slave = %d\n", master_slave);
@@ -1316,6 +5457,30 @@ int main(int argc, char *argv[])
 		printf("loopback_check = %d\n", loopback_check);
 		printf("    write_only = %d\n", write_only);
 		printf("     nopromisc = %d\n", nopromisc);
+		printf("    batch_size = %d\n", batch_size);
+		printf("    flush_usec = %d\n", flush_usec);
+		printf("rx_ring_blocks = %d\n", rx_ring_blocks);
+		printf("tx_ring_blocks = %d\n", tx_ring_blocks);
+		printf("    tap_queues = %d\n", tap_queues);
+		printf("     cpu_count = %d\n", cpu_count);
+		printf("    udp_shards = %d\n", udp_shards);
+		printf("     steer_cpu = %d\n", steer_cpu);
+		printf("       udp_gso = %d\n", udp_gso);
+		printf("      tap_vnet = %d\n", tap_vnet);
+		printf("crypto_workers = %d\n", crypto_workers);
+		printf("   rss_workers = %d\n", rss_workers);
+		printf("       metrics = %s\n", metrics_addr ? metrics_addr : "");
+		printf("           hub = %d\n", hub_max);
+		printf("tun_hdr_len/vni = %d/%u segs %d\n", tun_hdr_len, segs[0].vni, nsegs);
+		printf("  compress_lz4 = %d\n", compress_lz4);
+		printf("     aggregate = %d usec %d size %d\n", aggregate, aggr_usec, aggr_size);
+		printf("      path_mtu = %d pmtud %d\n", path_mtu, pmtud);
+		printf("     multipath = %d\n", multipath);
+		printf("          pcap = %s points 0x%x snaplen %d size %ld files %d\n", pcap_prefix ? pcap_prefix : "", pcap_points, pcap_snaplen,
+		       pcap_file_size, pcap_files);
+#ifdef ENABLE_TRACE
+		printf("         trace = %s\n", trace_file_name ? trace_file_name : "");
+#endif
 		printf("           cmd = ");
 		int n;
 		for (n = i; n < argc; n++)
@@ -1323,6 +5488,12 @@ int main(int argc, char *argv[])
 		printf("\n");
 	}
 
+	if (pcap_prefix) {
+		if (pcap_snaplen > PCAP_SLOT_DATA)
+			pcap_snaplen = PCAP_SLOT_DATA;
+		signal(SIGUSR1, pcap_signal);	// before fork, kill -USR1 to watchdog process is harmless
+	}
+
 	if (debug == 0) {
 		daemon_init("EthUDP", LOG_DAEMON);
 		while (1) {
@@ -1339,19 +5510,26 @@ int main(int argc, char *argv[])
 	}
 
 	signal(SIGHUP, sig_handler);
+#ifdef ENABLE_TRACE
+	if (trace_file_name)
+		trace_open(trace_file_name);
+#endif
 
 	if (mode == MODEE) {	// eth bridge mode
 		fdudp[MASTER] = udp_xconnect(argv[i], argv[i + 1], argv[i + 2], argv[i + 3], MASTER);
 		if (master_slave)
 			fdudp[SLAVE] = udp_xconnect(argv[i + 5], argv[i + 6], argv[i + 7], argv[i + 8], SLAVE);
 		fdraw = open_socket(argv[i + 4], &ifindex);
+		if (rx_ring_blocks || tx_ring_blocks)	// rings are global, only fdraw has them, -seg sockets use recvmsg/sendto
+			setup_packet_ring(fdraw, rx_ring_blocks, tx_ring_blocks);
+		fdtapq[0] = fdraw;
 	} else if (mode == MODEI) {	// interface mode
 		char *actualname = NULL;
 		char buf[MAXLEN];
 		fdudp[MASTER] = udp_xconnect(argv[i], argv[i + 1], argv[i + 2], argv[i + 3], MASTER);
 		if (master_slave)
 			fdudp[SLAVE] = udp_xconnect(argv[i + 6], argv[i + 7], argv[i + 8], argv[i + 9], SLAVE);
-		fdraw = open_tun("tap", &actualname);
+		fdraw = open_tun_queues("tap", &actualname);
 		snprintf(buf, MAXLEN, "/sbin/ip addr add %s/%s dev %s; /sbin/ip link set %s up", argv[i + 4], argv[i + 5], actualname, actualname);
 		if (debug)
 			printf(" run cmd: %s\n", buf);
@@ -1364,7 +5542,7 @@ int main(int argc, char *argv[])
 		fdudp[MASTER] = udp_xconnect(argv[i], argv[i + 1], argv[i + 2], argv[i + 3], MASTER);
 		if (master_slave)
 			fdudp[SLAVE] = udp_xconnect(argv[i + 5], argv[i + 6], argv[i + 7], argv[i + 8], SLAVE);
-		fdraw = open_tun("tap", &actualname);
+		fdraw = open_tun_queues("tap", &actualname);
 		snprintf(buf, MAXLEN, "/sbin/ip link set %s up; brctl addif %s %s", actualname, argv[i + 4], actualname);
 		if (debug)
 			printf(" run cmd: %s\n", buf);
@@ -1372,22 +5550,79 @@ int main(int argc, char *argv[])
 		if (debug)
 			system("/sbin/ip addr");
 	}
-	// create a pthread to forward packets from master udp to raw
-	if (pthread_create(&tid, NULL, (void *)process_udp_to_raw_master, NULL)
-	    != 0)
-		err_sys("pthread_create udp_to_raw_master error");
-
-	// create a pthread to forward packets from slave udp to raw
-	if (master_slave)
-		if (pthread_create(&tid, NULL, (void *)process_udp_to_raw_slave, NULL)
+	if (hub_max) {
+		if (!nat[MASTER] || master_slave || tun_hdr_len)
+			err_quit("hub mode needs remote port 0, no slave and no tunnel header(-vni/-seg/-z/-aggr/-mtu/-pmtud)");
+		hub_init();
+	}
+	if (path_mtu || pmtud) {
+		pmtu[MASTER] = path_mtu ? path_mtu : 1500;	// -pmtud sets the IP_MTU guess below
+		pmtu[SLAVE] = path_mtu ? path_mtu : 1500;
+		set_frag_size(MASTER);
+		if (master_slave)
+			set_frag_size(SLAVE);
+		frag_init();
+	}
+	if (pmtud) {
+		pmtud_init(MASTER);
+		if (master_slave)
+			pmtud_init(SLAVE);
+	}
+	for (q = 1; q < nsegs; q++) {
+		char *actualname = segs[q].ifname;
+		char buf[MAXLEN];
+		int k;
+		for (k = 0; k < q; k++)
+			if (segs[k].vni == segs[q].vni)
+				err_quit("vni %u used twice", segs[q].vni);
+		if (mode == MODEE) {
+			segs[q].fd = open_socket(segs[q].ifname, &segs[q].ifindex);
+			continue;
+		}
+		segs[q].fd = open_tun(segs[q].ifname, &actualname);
+		if (segs[q].bridge)
+			snprintf(buf, MAXLEN, "/sbin/ip link set %s up; brctl addif %s %s", actualname, segs[q].bridge, actualname);
+		else
+			snprintf(buf, MAXLEN, "/sbin/ip link set %s up", actualname);
+		if (debug)
+			printf(" run cmd: %s\n", buf);
+		system(buf);
+	}
+	for (q = 0; q < max(tap_queues, udp_shards); q++) {
+		// create a pthread to forward packets from master udp to raw
+		if (pthread_create(&tid, NULL, (void *)process_udp_to_raw_master, (void *)q)
 		    != 0)
-			err_sys("pthread_create udp_to_raw_slave error");
+			err_sys("pthread_create udp_to_raw_master error");
+
+		// create a pthread to forward packets from slave udp to raw
+		if (master_slave)
+			if (pthread_create(&tid, NULL, (void *)process_udp_to_raw_slave, (void *)q)
+			    != 0)
+				err_sys("pthread_create udp_to_raw_slave error");
+
+		// create a pthread to forward packets from raw queue q to udp, queue 0 by main thread
+		if ((q > 0) && (q < tap_queues))
+			if (pthread_create(&tid, NULL, (void *)process_raw_to_udp, (void *)q) != 0)
+				err_sys("pthread_create raw_to_udp error");
+	}
+
+	for (q = 1; q < nsegs; q++)	// one raw->udp thread per segment
+		if (pthread_create(&tid, NULL, (void *)process_seg_to_udp, (void *)q) != 0)
+			err_sys("pthread_create seg_to_udp error");
 
 	if (pthread_create(&tid, NULL, (void *)send_keepalive_to_udp, NULL) != 0)	// send keepalive to remote  
 		err_sys("pthread_create send_keepalive error");
 
+	if (metrics_addr)
+		if (pthread_create(&tid, NULL, (void *)metrics_thread, (void *)(long)metrics_listen(metrics_addr)) != 0)
+			err_sys("pthread_create metrics error");
+
+	if (pcap_prefix)
+		if (pthread_create(&tid, NULL, (void *)pcap_thread, NULL) != 0)
+			err_sys("pthread_create pcap error");
+
 	//  forward packets from raw to udp
-	process_raw_to_udp();
+	process_raw_to_udp(0);
 
 	return 0;
 }
@@ -0,0 +1,185 @@
+/* udp traffic generator and sink for bench/run.sh
+
+   gen -s port [ -w sec ]                          sink, prints result when the generator ends
+   gen -c ip port [ -l len ] [ -t sec ] [ -r pps ] generator, -r 0 sends as fast as it can
+
+   each packet carries sequence and CLOCK_MONOTONIC send time, both ends run on one host,
+   so the sink measures one way latency, not rtt/2
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAGIC		0x45544855	// "ETHU"
+#define END_SEQ		0xffffffffffffffffULL	// last packets, ts is count of sent packets
+#define LAT_BUCKETS	1000000	// 1 usec each, the last one is 1s or more
+#define BURST		32
+
+struct gen_hdr {
+	u_int32_t magic, len;
+	u_int64_t seq, ts;
+};
+
+u_int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void usage(void)
+{
+	printf("gen -s port [ -w sec ]\n");
+	printf("gen -c ip port [ -l len ] [ -t sec ] [ -r pps ]\n");
+	exit(1);
+}
+
+/* usec of percentile p in latency histogram */
+int lat_percentile(u_int64_t * h, u_int64_t n, double p)
+{
+	u_int64_t want = n * p, sum = 0;
+	int i;
+	for (i = 0; i < LAT_BUCKETS; i++)
+		if ((sum += h[i]) > want)
+			return i;
+	return LAT_BUCKETS - 1;
+}
+
+int sink(int port, int wait)
+{
+	struct sockaddr_in sa;
+	struct timeval tv = { 1, 0 };
+	struct gen_hdr *g;
+	u_int8_t buf[65536];
+	u_int64_t *lat, got = 0, bytes = 0, sent = 0, first = 0, last = 0, t, idle = 0;
+	int fd, len, done = 0;
+	double sec;
+
+	lat = calloc(LAT_BUCKETS, sizeof(u_int64_t));
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if ((lat == NULL) || (fd < 0) || (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)) {
+		perror("sink");
+		return 1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (!done) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < (int)sizeof(struct gen_hdr)) {
+			if ((len < 0) && (++idle >= (u_int64_t) wait))	// generator gone
+				break;
+			continue;
+		}
+		idle = 0;
+		g = (struct gen_hdr *)buf;
+		if ((g->magic != MAGIC) || (g->len != (u_int32_t) len))
+			continue;
+		if (g->seq == END_SEQ) {
+			sent = g->ts;
+			done = 1;
+			break;
+		}
+		t = now_ns();
+		if (got++ == 0)
+			first = t;
+		last = t;
+		bytes += len;
+		t = (t - g->ts) / 1000;
+		lat[t < LAT_BUCKETS ? t : LAT_BUCKETS - 1]++;
+	}
+	sec = (last - first) / 1e9;
+	if (sec <= 0)
+		sec = 1e-9;
+	printf("%8.3f Mpps %7.3f Gbps", got / sec / 1e6, bytes * 8 / sec / 1e9);
+	if (sent)
+		printf("  loss %6.2f%%", sent > got ? (sent - got) * 100.0 / sent : 0.0);
+	else
+		printf("  loss    n/a");
+	printf("  latency usec p50 %d p90 %d p99 %d p999 %d\n", lat_percentile(lat, got, 0.5), lat_percentile(lat, got, 0.9),
+	       lat_percentile(lat, got, 0.99), lat_percentile(lat, got, 0.999));
+	return 0;
+}
+
+int generator(char *ip, int port, int len, int sec, u_int64_t pps)
+{
+	struct sockaddr_in sa;
+	struct gen_hdr *g;
+	u_int8_t buf[65536];
+	u_int64_t seq = 0, start, end, t;
+	int fd, i;
+
+	if ((len < (int)sizeof(struct gen_hdr)) || (len > 65000))
+		usage();
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if ((fd < 0) || (inet_pton(AF_INET, ip, &sa.sin_addr) != 1) || (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)) {
+		perror("generator");
+		return 1;
+	}
+	memset(buf, 0, sizeof(buf));
+	g = (struct gen_hdr *)buf;
+	g->magic = MAGIC;
+	g->len = len;
+	start = now_ns();
+	end = start + sec * 1000000000ULL;
+	while ((t = now_ns()) < end) {
+		if (pps && (seq * 1000000000ULL / pps > t - start))	// ahead of rate
+			continue;
+		for (i = 0; i < BURST; i++) {
+			g->seq = seq;
+			g->ts = now_ns();
+			if (send(fd, buf, len, 0) == len)
+				seq++;
+			if (pps)
+				break;
+		}
+	}
+	usleep(500000);		// let the tunnel drain
+	g->seq = END_SEQ;
+	g->ts = seq;
+	for (i = 0; i < 5; i++) {
+		send(fd, buf, len, 0);
+		usleep(100000);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i = 1, len = 64, sec = 5, wait = 5;
+	u_int64_t pps = 0;
+
+	if (argc < 3)
+		usage();
+	if (strcmp(argv[1], "-s") == 0) {
+		for (i = 3; i + 1 < argc; i += 2)
+			if (strcmp(argv[i], "-w") == 0)
+				wait = atoi(argv[i + 1]);
+			else
+				usage();
+		return sink(atoi(argv[2]), wait);
+	}
+	if ((strcmp(argv[1], "-c") != 0) || (argc < 4))
+		usage();
+	for (i = 4; i + 1 < argc; i += 2)
+		if (strcmp(argv[i], "-l") == 0)
+			len = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-t") == 0)
+			sec = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-r") == 0)
+			pps = strtoull(argv[i + 1], NULL, 10);
+		else
+			usage();
+	return generator(argv[2], atoi(argv[3]), len, sec, pps);
+}
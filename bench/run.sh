@@ -0,0 +1,100 @@
+#!/bin/bash
+# one host end to end test of EthUDP, needs root, ip and ethtool
+#
+# namespaces na/nb linked by veth va/vb carry the udp tunnel. mode i sends bench/gen traffic between the taps
+# of na/nb, mode e bridges ea/eb to hosts ha/hb, mode b adds ea/eb and the tap to bridge br0 in na/nb.
+# bench/gen reports pps, Gbps, loss and one way latency percentiles of each mode, cipher and packet size.
+#
+# usage: bench/run.sh [ "more EthUDP options" ]
+# env:   MODES="e i b" ENCS="none aes-128-gcm" LENS="64 1400" DUR=5 RATE=0 (pps of generator, 0 as fast as it can)
+
+cd "$(dirname "$0")/.." || exit 1
+make -s EthUDP bench/gen || exit 1
+[ "$(id -u)" = 0 ] || { echo "bench/run.sh needs root"; exit 1; }
+
+OPTS="$1"
+MODES=${MODES:-e i b}
+ENCS=${ENCS:-none aes-128-gcm}
+LENS=${LENS:-64 1400}
+DUR=${DUR:-5}
+RATE=${RATE:-0}
+NS="na nb ha hb"
+
+cleanup() {
+	kill $(jobs -p) 2>/dev/null
+	# EthUDP without -d forks to a daemon and a watchdog, they are not jobs of this shell
+	for i in 1 2 3 4 5; do
+		p=$(for n in $NS; do ip netns pids $n 2>/dev/null; done)
+		[ -z "$p" ] && break
+		kill $p 2>/dev/null
+		sleep 0.2
+	done
+	wait 2>/dev/null
+	for n in $NS; do ip netns del $n 2>/dev/null; done
+}
+trap cleanup EXIT
+
+setup() {
+	for n in $NS; do ip netns add $n; ip -n $n link set lo up; done
+	ip link add va type veth peer name vb
+	ip link set va netns na; ip link set vb netns nb
+	ip -n na addr add 10.9.0.1/24 dev va; ip -n na link set va up
+	ip -n nb addr add 10.9.0.2/24 dev vb; ip -n nb link set vb up
+	[ "$1" = i ] && return
+	ip link add ea type veth peer name ha0; ip link set ea netns na; ip link set ha0 netns ha
+	ip link add eb type veth peer name hb0; ip link set eb netns nb; ip link set hb0 netns hb
+	ip -n na link set ea up; ip -n nb link set eb up
+	ip -n ha addr add 10.7.0.1/24 dev ha0; ip -n ha link set ha0 up
+	ip -n hb addr add 10.7.0.2/24 dev hb0; ip -n hb link set hb0 up
+	# veth leaves checksum and segmentation to the peer, raw socket and tap send frames as they are
+	ip netns exec ha ethtool -K ha0 tx off tso off gso off >/dev/null
+	ip netns exec hb ethtool -K hb0 tx off tso off gso off >/dev/null
+	if [ "$1" = b ]; then
+		for n in na nb; do
+			ip -n $n link add br0 type bridge
+			ip -n $n link set e${n:1} master br0
+			ip -n $n link set br0 up
+		done
+	fi
+}
+
+# start EthUDP pair of mode $1 with cipher $2, set SRC DST IP of the generator
+start() {
+	local o="$OPTS"
+	[ "$2" != none ] && o="$o -enc $2 -k bench"
+	case $1 in
+	e)
+		ip netns exec na ./EthUDP -e $o 10.9.0.1 6000 10.9.0.2 6000 ea >/dev/null 2>&1 &
+		ip netns exec nb ./EthUDP -e $o 10.9.0.2 6000 10.9.0.1 6000 eb >/dev/null 2>&1 &
+		SRC=ha DST=hb IP=10.7.0.2 ;;
+	i)
+		ip netns exec na ./EthUDP -i $o 10.9.0.1 6000 10.9.0.2 6000 10.8.0.1 24 >/dev/null 2>&1 &
+		ip netns exec nb ./EthUDP -i $o 10.9.0.2 6000 10.9.0.1 6000 10.8.0.2 24 >/dev/null 2>&1 &
+		SRC=na DST=nb IP=10.8.0.2 ;;
+	b)
+		ip netns exec na ./EthUDP -b $o 10.9.0.1 6000 10.9.0.2 6000 br0 >/dev/null 2>&1 &
+		ip netns exec nb ./EthUDP -b $o 10.9.0.2 6000 10.9.0.1 6000 br0 >/dev/null 2>&1 &
+		SRC=ha DST=hb IP=10.7.0.2 ;;
+	esac
+	sleep 2
+	if [ "$1" = b ]; then	# EthUDP adds tap0 by brctl, which may not be installed
+		ip -n na link set tap0 master br0 2>/dev/null
+		ip -n nb link set tap0 master br0 2>/dev/null
+	fi
+	ip netns exec $SRC ping -c 1 -W 1 $IP >/dev/null 2>&1	# learn arp
+}
+
+for m in $MODES; do
+	for e in $ENCS; do
+		cleanup
+		setup $m
+		start $m $e
+		for l in $LENS; do
+			printf "mode %s %-18s %5d bytes " $m $e $l
+			ip netns exec $DST bench/gen -s 7000 -w $((DUR + 5)) &
+			sleep 0.5
+			ip netns exec $SRC bench/gen -c $IP 7000 -l $l -t $DUR -r $RATE
+			wait $!
+		done
+	done
+done